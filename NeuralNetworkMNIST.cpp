@@ -1,21 +1,36 @@
 #include <fstream>
 #include <pthread.h>
 #include <vector>
+#include <chrono>
+#include <cstring>
 
 #include "src/common.cpp"
 #include "src/tensor.cpp"
+#include "src/tensor_view.cpp"
 #include "src/tensor_float.cpp"
 #include "src/tensor_gradient.cpp"
-#include "src/gradient.cpp"
 #include "src/layer.cpp"
 #include "src/convolutional_layer.cpp"
 #include "src/relu_layer.cpp"
 #include "src/pool_layer.cpp"
 #include "src/fully_connected_layer.cpp"
-#include "src/input_case.cpp"
+#include "src/conv_relu_pool_layer.cpp"
+#include "src/layout_conversion_layer.cpp"
+#include "src/fixed_shape_layers.cpp"
+#include "src/softmax_cross_entropy_layer.cpp"
+#include "src/workspace.cpp"
+#include "src/idx_dataset.cpp"
+#include "src/batch_loader.cpp"
+#include "src/data_parallel_trainer.cpp"
+#include "src/hogwild_trainer.cpp"
+#include "src/snapshot_policy.cpp"
 #include "src/tensor_render_frame_buffer.cpp"
 #include "src/layer_grid_frame_buffer.cpp"
+#include "src/surface_mesh.cpp"
 
+// Define TENSAR_HEADLESS to build the trainer without OpenGL/GLUT: the layers do not
+// allocate render buffers, their render hooks compile to nothing and no window is opened.
+#ifndef TENSAR_HEADLESS
 #ifdef __APPLE__
 #include <GLUT/glut.h>
 #else
@@ -25,6 +40,7 @@
 #ifdef _WIN32
 #define GL_CLAMP_TO_EDGE 0x812F
 #endif	
+#endif
 
 #define INPUT_WIDTH 28
 #define INPUT_HEIGHT 28
@@ -34,6 +50,24 @@
 #define OUTPUT_HEIGHT 1
 #define OUTPUT_DEPTH 1
 
+#define BATCH_SIZE 1 // samples per weight update, 1 trains case by case, --batch
+#define TRAINING_THREADS 1 // threads sharing every batch, requires a batch size >= threads, --threads
+#define HOGWILD_THREADS 0 // > 0 trains case by case on that many threads updating the weights without locks, --hogwild
+#define HOGWILD_CHUNK_SIZE 1000 // cases trained asynchronously between two reports
+#define SCALING_SAMPLES 12000 // samples timed per thread count by --scaling
+#define SCALING_BATCH_SIZE 64 // batch size of the data-parallel runs of --scaling, unless --batch is given
+#define FUSE_LAYERS 1 // trains Conv -> ReLU -> Pool as a single fused layer, except on snapshot steps
+#define FIXED_SHAPE_LAYERS 1 // builds the topology from layers whose shapes are compile-time constants
+#define CHANNELS_LAST 0 // runs the convolution, ReLU and pool layers that can on channel-last (NHWC) tensors, left unfused
+#define LOADER_QUEUE_SIZE 4 // mini-batches prefetched ahead of the training thread
+#define SNAPSHOT_EVERY_STEPS 0 // > 0 also refreshes the render buffers every N training steps
+#define SNAPSHOT_EVERY_MS 0 // > 0 also refreshes the render buffers every X milliseconds
+#define DEFAULT_OPTIMIZER "sgd" // sgd, nesterov or adam, --optimizer on the command line
+#define DEFAULT_LEARNING_RATE 0.003 // --lr
+#define DEFAULT_ADAM_LEARNING_RATE 0.0005 // --lr of adam, which diverges at the SGD rate
+#define DEFAULT_MOMENTUM 0.6 // --momentum, also the first moment decay of adam
+#define DEFAULT_WEIGHT_DECAY 0.001 // --weight-decay
+
 #define SCREEN_WIDTH 1280
 #define SCREEN_HEIGHT 740
 
@@ -44,6 +78,8 @@ vector<Layer*> layers;
 bool paused = false;
 TensorRenderFrameBuffer* currentInputTensorFrameBuffer = NULL;
 TensorRenderFrameBuffer* selectedTensorFrameBuffer = NULL;
+SurfaceMesh selectedTensorMesh; // 3D chart of the selected tensor
+SnapshotPolicy snapshot_policy(SNAPSHOT_EVERY_STEPS, SNAPSHOT_EVERY_MS); // the display requests a snapshot on every frame
 int iteration = 0;
 int expected_label, predicted_label;
 int timebase_timestamp = 0;
@@ -56,28 +92,7 @@ char press_space_buffer_msg[40];
 int mouse_x = 0;
 int mouse_y = 0;
 
-uint32_t byteswapUint32(uint32_t a)
-{
-        return ((((a >> 24) & 0xff) << 0) |
-                (((a >> 16) & 0xff) << 8) |
-                (((a >> 8) & 0xff) << 16) |
-                (((a >> 0) & 0xff) << 24));
-}
-
-uint8_t* readFile( const char* szFile )
-{
-        ifstream file( szFile, ios::binary | ios::ate );
-        streamsize size = file.tellg();
-        file.seekg( 0, ios::beg );
-
-        if ( size == -1 )
-                return nullptr;
-
-        uint8_t* buffer = new uint8_t[size];
-        file.read( (char*)buffer, size );
-        return buffer;
-}
-
+#ifndef TENSAR_HEADLESS
 void drawString(int x, int y, char* msg, void *font = GLUT_BITMAP_HELVETICA_10) {
         glColor3d(0.0, 0.0, 0.0);
         glRasterPos2d(x, SCREEN_HEIGHT - y);
@@ -86,31 +101,37 @@ void drawString(int x, int y, char* msg, void *font = GLUT_BITMAP_HELVETICA_10)
         }
 }
 
+// Returns the texture of the frame buffer. The texture is created once and updated in place
+// only when the consumer has taken a frame that was not uploaded yet.
 GLuint loadTextureWithTensorRenderFrameBuffer(TensorRenderFrameBuffer *tensorFrameBuffer)
 {
-        tensorFrameBuffer->consumer_mutex.lock();
-        tensorFrameBuffer->is_consuming_frame_buffer = true;
+        tensorFrameBuffer->consume(); // take the latest frame published by the training thread, if any
 
         if(tensorFrameBuffer->consumer_frame_buffer == NULL) {
                 return 0;
         }
 
-        if(tensorFrameBuffer->texture) {
-                // Delete previous generated texture
-                glDeleteTextures(1, &tensorFrameBuffer->texture);
+        if(!tensorFrameBuffer->texture) {
+                // no mipmaps: the texture is always sampled with GL_NEAREST
+                glGenTextures( 1, &tensorFrameBuffer->texture );
+                glBindTexture( GL_TEXTURE_2D, tensorFrameBuffer->texture );
+                glTexParameteri( GL_TEXTURE_2D, GL_TEXTURE_MIN_FILTER, GL_NEAREST );
+                glTexParameteri( GL_TEXTURE_2D, GL_TEXTURE_MAG_FILTER, GL_NEAREST );
+                glTexParameteri( GL_TEXTURE_2D, GL_TEXTURE_WRAP_S, GL_CLAMP_TO_EDGE );
+                glTexParameteri( GL_TEXTURE_2D, GL_TEXTURE_WRAP_T, GL_CLAMP_TO_EDGE );
+                glTexImage2D( GL_TEXTURE_2D, 0, GL_RGBA, tensorFrameBuffer->texture_width, tensorFrameBuffer->texture_height, 0, GL_RGBA, GL_UNSIGNED_BYTE, tensorFrameBuffer->consumer_frame_buffer);
+                tensorFrameBuffer->texture_generation = tensorFrameBuffer->consumer_generation;
+        } else {
+                glBindTexture( GL_TEXTURE_2D, tensorFrameBuffer->texture );
+                if(tensorFrameBuffer->texture_generation != tensorFrameBuffer->consumer_generation) {
+                        // only the tensor pixels changed: upload width x height out of the rows of the frame buffer
+                        glPixelStorei( GL_UNPACK_ROW_LENGTH, tensorFrameBuffer->texture_width );
+                        glTexSubImage2D( GL_TEXTURE_2D, 0, 0, 0, tensorFrameBuffer->width, tensorFrameBuffer->height, GL_RGBA, GL_UNSIGNED_BYTE, tensorFrameBuffer->consumer_frame_buffer);
+                        glPixelStorei( GL_UNPACK_ROW_LENGTH, 0 );
+                        tensorFrameBuffer->texture_generation = tensorFrameBuffer->consumer_generation;
+                }
         }
-
-        glGenTextures( 1, &tensorFrameBuffer->texture );
-        glBindTexture( GL_TEXTURE_2D, tensorFrameBuffer->texture );
         glTexEnvf( GL_TEXTURE_ENV, GL_TEXTURE_ENV_MODE, GL_MODULATE );
-        glTexParameteri( GL_TEXTURE_2D, GL_TEXTURE_MIN_FILTER, GL_NEAREST );
-        glTexParameteri( GL_TEXTURE_2D, GL_TEXTURE_MAG_FILTER, GL_NEAREST );
-        glTexParameteri( GL_TEXTURE_2D, GL_TEXTURE_WRAP_S, GL_CLAMP_TO_EDGE );
-        glTexParameteri( GL_TEXTURE_2D, GL_TEXTURE_WRAP_T, GL_CLAMP_TO_EDGE );
-        gluBuild2DMipmaps( GL_TEXTURE_2D, GL_RGBA, tensorFrameBuffer->texture_width, tensorFrameBuffer->texture_height, GL_RGBA, GL_UNSIGNED_BYTE, tensorFrameBuffer->consumer_frame_buffer);
-
-        tensorFrameBuffer->is_consuming_frame_buffer = false;
-        tensorFrameBuffer->consumer_mutex.unlock();
 
         return tensorFrameBuffer->texture;
 }
@@ -267,79 +288,28 @@ void display(void)
         glutBitmapCharacter(GLUT_BITMAP_HELVETICA_12, 'z');
 
         if(selectedTensorFrameBuffer != NULL) {
-                selectedTensorFrameBuffer->consumer_mutex.lock();
-                selectedTensorFrameBuffer->is_consuming_frame_buffer = true;
+                selectedTensorFrameBuffer->consume();
+                selectedTensorMesh.update(selectedTensorFrameBuffer, 300.0f, 900.0f, 50.0f);
 
-                float cell_width = 300.0f / selectedTensorFrameBuffer->width;
-                float cell_height = 900.0f / selectedTensorFrameBuffer->height;
                 glMatrixMode(GL_MODELVIEW);
-                glBegin(GL_QUADS);
-                int i, _i, j, _j;
-                int frameBufferWidth = max(selectedTensorFrameBuffer->width - 1, 1);
-                int frameBufferHeight = max(selectedTensorFrameBuffer->height - 1, 1);
-                for(i = 0; i < frameBufferWidth; _i = i++) {
-                        for(j = 0; j < frameBufferHeight; j++) {
-                                _i = (i == selectedTensorFrameBuffer->width - 1) ? i : i+1;
-                                _j = (j == selectedTensorFrameBuffer->height - 1) ? j : j+1;
-
-                                //top left
-                                glColor4ub(selectedTensorFrameBuffer->getRed(i, j), selectedTensorFrameBuffer->getGreen(i, j), selectedTensorFrameBuffer->getBlue(i, j), 255);
-                                glVertex3f (i*cell_width + axis_x_offset, ((selectedTensorFrameBuffer->getValue(i, j) * 50) / 255) + axis_y_offset, -j*cell_height);
-                                //bottom left
-                                glColor4ub(selectedTensorFrameBuffer->getRed(i, _j), selectedTensorFrameBuffer->getGreen(i, _j), selectedTensorFrameBuffer->getBlue(i, _j), 255);
-                                glVertex3f (i*cell_width + axis_x_offset, ((selectedTensorFrameBuffer->getValue(i, _j) * 50) / 255) + axis_y_offset, -(j+1)*cell_height);
-                                //bottom right
-                                glColor4ub(selectedTensorFrameBuffer->getRed(_i, _j), selectedTensorFrameBuffer->getGreen(_i, _j), selectedTensorFrameBuffer->getBlue(_i, _j), 255);
-                                glVertex3f ((i+1)*cell_width + axis_x_offset, ((selectedTensorFrameBuffer->getValue(_i, _j) * 50) / 255) + axis_y_offset, -(j+1)*cell_height);
-                                //top right
-                                glColor4ub(selectedTensorFrameBuffer->getRed(_i, j), selectedTensorFrameBuffer->getGreen(_i, j), selectedTensorFrameBuffer->getBlue(_i, j), 255);
-                                glVertex3f ((i+1)*cell_width + axis_x_offset, ((selectedTensorFrameBuffer->getValue(_i, j) * 50) / 255) + axis_y_offset, -(j)*cell_height);
-                        }
-                }
-                glEnd();
-
-                selectedTensorFrameBuffer->is_consuming_frame_buffer = false;
-                selectedTensorFrameBuffer->consumer_mutex.unlock();
+                glPushMatrix();
+                glTranslatef(axis_x_offset, axis_y_offset, 0.0f);
+                glEnableClientState(GL_VERTEX_ARRAY);
+                glEnableClientState(GL_COLOR_ARRAY);
+                glVertexPointer(3, GL_FLOAT, 0, selectedTensorMesh.vertices.data());
+                glColorPointer(4, GL_UNSIGNED_BYTE, 0, selectedTensorMesh.colors.data());
+                glDrawElements(GL_TRIANGLES, selectedTensorMesh.indices.size(), GL_UNSIGNED_INT, selectedTensorMesh.indices.data());
+                glDisableClientState(GL_COLOR_ARRAY);
+                glDisableClientState(GL_VERTEX_ARRAY);
+                glPopMatrix();
         }
         /*** END: 3D selected tensor chart ***/
 
         glFlush();
         glutSwapBuffers();
-}
-
-vector<InputCase*> readInputDataset()
-{
-        vector<InputCase*> cases;
-
-        uint8_t* train_image = readFile( "train-images.idx3-ubyte" );
-        uint8_t* train_labels = readFile( "train-labels.idx1-ubyte" );
-        uint32_t case_count = byteswapUint32( *(uint32_t*)(train_image + 4) );
-
-        for(int i = 0; i < case_count; i++)
-        {
-                size_tensor input_size{INPUT_WIDTH, INPUT_HEIGHT, INPUT_DEPTH};
-                size_tensor output_size{OUTPUT_WIDTH, OUTPUT_HEIGHT, OUTPUT_DEPTH};
 
-                InputCase *c = new InputCase(input_size, output_size);
-
-                uint8_t* img = train_image + 16 + i * (INPUT_WIDTH * INPUT_HEIGHT);
-                uint8_t* label = train_labels + 8 + i;
-
-                for ( int x = 0; x < INPUT_WIDTH; x++ )
-                        for ( int y = 0; y < INPUT_HEIGHT; y++ ) {
-                                (*c->data)(x, y, 0) = img[x + y * INPUT_WIDTH] / 255.f;
-                        }
-
-                for ( int b = 0; b < OUTPUT_WIDTH; b++ ) {
-                        (*c->output)(b, 0, 0) = *label == b ? 1.0f : 0.0f;
-                }
-
-                cases.push_back(c);
-        }
-
-        delete[] train_image;
-        delete[] train_labels;
-        return cases;
+        // the training thread refreshes the render buffers on its next step
+        snapshot_policy.request();
 }
 
 static void keyboard(int key, int x, int y) {
@@ -374,69 +344,242 @@ void reshape(int w, int h)
         glMatrixMode(GL_PROJECTION);
         glLoadIdentity();
 }
+#endif
 
-float train(vector<Layer*> &layers, InputCase *input_case)//TensorFloat *data, TensorFloat *expected)
+// Runs forward, backward and a single weights update for all the samples of the data tensor and
+// returns the summed error %, 100 per misclassified sample. The layers end with the loss layer.
+// The temporaries of the step live in the workspace, so it allocates nothing on the planned batch size.
+float train(vector<Layer*> &layers, Workspace *workspace, TensorFloat *data, TensorFloat *expected)
 {
+        if(data->batch != workspace->batch_size)
+                workspace->plan(layers, data->batch);
+
         for(int i = 0; i < layers.size(); i++) {
                 Layer *layer = layers[i];
 
-                if(i == 0) { layer->activate(input_case->data); }
-                else       { layer->activate(layers[i - 1]->output); }
+                if(i == 0) { layer->activate(data->view()); }
+                else       { layer->activate(layers[i - 1]->output->view()); }
         }
 
-        //output of the last layer must have the same size as the case expected size
-        TensorFloat* diff_gradient = TensorFloat::diff(layers.back()->output, input_case->output); // difference between the neural network output and expected output
-
+        // the loss layer takes the expected output in place of the next layer gradients
         for(int i = layers.size() - 1; i >= 0; i--) {
-                if(i == layers.size() - 1)  { layers[i]->calc_grads(diff_gradient); }
-                else                        { layers[i]->calc_grads(layers[i + 1]->input_gradients); }
+                if(i == layers.size() - 1)  { layers[i]->calc_grads(expected->view()); }
+                else                        { layers[i]->calc_grads(layers[i + 1]->input_gradients->view()); }
         }
 
         for(int i = 0; i < layers.size(); i++) {
                 layers[i]->fix_weights();
         }
 
-        float err = 0;
+        return ((SoftmaxCrossEntropyLayer*)layers.back())->errors * 100.0f;
+}
+
+// Value of the option at argv[i], which must be followed by a number; exits on errors
+static float option_value(int argc, char *argv[], int i) {
+        if(i + 1 >= argc) {
+                cerr << "Missing value for " << argv[i] << endl;
+                exit(1);
+        }
+        char *end;
+        float value = strtof(argv[i + 1], &end);
+        if(end == argv[i + 1] || *end != '\0' || !isfinite(value)) {
+                cerr << "Invalid value " << argv[i + 1] << " for " << argv[i] << endl;
+                exit(1);
+        }
+        return value;
+}
+
+// Value of the option at argv[i], which must be followed by a whole number; exits on errors
+static int option_count(int argc, char *argv[], int i) {
+        float value = option_value(argc, argv, i);
+        if(value != (int)value) {
+                cerr << "Invalid value " << argv[i + 1] << " for " << argv[i] << ", expected a whole number" << endl;
+                exit(1);
+        }
+        return (int)value;
+}
+
+// Options of the command line, the other arguments are left to GLUT
+struct TrainingOptions
+{
+        Optimizer *optimizer = NULL;
+        int batch_size = BATCH_SIZE;
+        int threads = TRAINING_THREADS;
+        int hogwild_threads = HOGWILD_THREADS;
+        int scaling = 0; // > 0 times training with 1 to that many threads, then exits
+};
+
+static TrainingOptions parse_options(int argc, char *argv[]) {
+        TrainingOptions options;
+        const char *name = DEFAULT_OPTIMIZER;
+        float learning_rate = 0;
+        float momentum = DEFAULT_MOMENTUM;
+        float weight_decay = DEFAULT_WEIGHT_DECAY;
+        bool learning_rate_set = false;
+        bool momentum_set = false;
+        bool batch_size_set = false;
+
+        for(int i = 1; i < argc; i++) {
+                if(strcmp(argv[i], "--optimizer") == 0) {
+                        if(i + 1 >= argc) {
+                                cerr << "Missing value for --optimizer" << endl;
+                                exit(1);
+                        }
+                        name = argv[++i];
+                }
+                else if(strcmp(argv[i], "--lr") == 0) {
+                        learning_rate = option_value(argc, argv, i++);
+                        learning_rate_set = true;
+                }
+                else if(strcmp(argv[i], "--momentum") == 0) {
+                        momentum = option_value(argc, argv, i++);
+                        momentum_set = true;
+                }
+                else if(strcmp(argv[i], "--weight-decay") == 0)
+                        weight_decay = option_value(argc, argv, i++);
+                else if(strcmp(argv[i], "--batch") == 0) {
+                        options.batch_size = option_count(argc, argv, i++);
+                        batch_size_set = true;
+                }
+                else if(strcmp(argv[i], "--threads") == 0)
+                        options.threads = option_count(argc, argv, i++);
+                else if(strcmp(argv[i], "--hogwild") == 0)
+                        options.hogwild_threads = option_count(argc, argv, i++);
+                else if(strcmp(argv[i], "--scaling") == 0)
+                        options.scaling = option_count(argc, argv, i++);
+        }
+
+        if(learning_rate_set && learning_rate <= 0) {
+                cerr << "--lr must be greater than 0" << endl;
+                exit(1);
+        }
+        if(momentum < 0 || momentum >= 1) {
+                cerr << "--momentum must be in [0, 1)" << endl;
+                exit(1);
+        }
+        if(weight_decay < 0) {
+                cerr << "--weight-decay must not be negative" << endl;
+                exit(1);
+        }
+        if(options.scaling > 0 && !batch_size_set)
+                options.batch_size = max(SCALING_BATCH_SIZE, options.scaling);
+        if(options.batch_size < 1 || options.threads < 1 || options.hogwild_threads < 0 || options.scaling < 0) {
+                cerr << "--batch and --threads must be at least 1, --hogwild and --scaling must not be negative" << endl;
+                exit(1);
+        }
+        if(options.hogwild_threads > 0 && options.threads > 1) {
+                cerr << "--threads and --hogwild can not be combined" << endl;
+                exit(1);
+        }
+        if(options.batch_size < max(options.threads, options.scaling)) {
+                cerr << "--batch must be at least the number of threads sharing every batch" << endl;
+                exit(1);
+        }
+
+        if(strcmp(name, "sgd") == 0)
+                options.optimizer = new SgdOptimizer(learning_rate_set ? learning_rate : DEFAULT_LEARNING_RATE, momentum, weight_decay);
+        else if(strcmp(name, "nesterov") == 0)
+                options.optimizer = new SgdOptimizer(learning_rate_set ? learning_rate : DEFAULT_LEARNING_RATE, momentum, weight_decay, true);
+        else if(strcmp(name, "adam") == 0)
+                options.optimizer = new AdamOptimizer(learning_rate_set ? learning_rate : DEFAULT_ADAM_LEARNING_RATE, weight_decay, momentum_set ? momentum : 0.9f);
+        else {
+                cerr << "Unknown optimizer " << name << ", expected sgd, nesterov or adam" << endl;
+                exit(1);
+        }
+        return options;
+}
 
-        //check if the output of the last layer have the same size as the case expected size
-        if((diff_gradient->size.width == input_case->output->size.width) && (diff_gradient->size.height == input_case->output->size.height) && (diff_gradient->size.depth == input_case->output->size.depth)) {
-                //calculate the error %
-                for(int i = 0; i < diff_gradient->size.width * diff_gradient->size.height * diff_gradient->size.depth; i++) {
-                        float f = input_case->output->values[i];
-                        if(f > 0.5)
-                                err += abs(diff_gradient->values[i]);
+// Trains SCALING_SAMPLES samples with 1 to max_threads threads, sharing every batch with the
+// DataParallelTrainer and then case by case with the HogwildTrainer, and prints the samples/s
+// and the speedup over one thread of every run. All the runs keep training the same layers.
+static void benchmark_scaling(vector<Layer*> &network, IdxDataset *dataset, int max_threads, int batch_size) {
+        for(int hogwild = 0; hogwild <= 1; hogwild++) {
+                int step = hogwild ? HOGWILD_CHUNK_SIZE : batch_size;
+                double single_thread_rate = 0;
+                for(int threads = 1; threads <= max_threads; threads++) {
+                        DataParallelTrainer *trainer = hogwild ? NULL : new DataParallelTrainer(network, threads, batch_size);
+                        HogwildTrainer *hogwild_trainer = hogwild ? new HogwildTrainer(network, threads, train) : NULL;
+                        BatchLoader loader(dataset, step, LOADER_QUEUE_SIZE);
+                        chrono::steady_clock::time_point start;
+                        long samples = 0;
+                        for(int b = -1; samples < SCALING_SAMPLES; b++) {
+                                if(b == 0)
+                                        start = chrono::steady_clock::now(); // the first batch warms the caches up
+                                BatchSlot *batch = loader.next();
+                                if(hogwild)
+                                        hogwild_trainer->train(batch->data, batch->expected);
+                                else
+                                        trainer->train(batch->data, batch->expected);
+                                loader.release();
+                                if(b >= 0)
+                                        samples += step;
+                        }
+                        double rate = samples / chrono::duration<double>(chrono::steady_clock::now() - start).count();
+                        if(threads == 1)
+                                single_thread_rate = rate;
+                        cout << (hogwild ? "hogwild" : "data-parallel batch=" + to_string(batch_size)) << " threads=" << threads << " samples/s=" << rate
+                             << " speedup=" << rate / single_thread_rate << endl;
+                        delete trainer;
+                        delete hogwild_trainer;
                 }
         }
+}
 
-        delete diff_gradient;
-        return err * 100;
+// Prints the multiply reduction of every Winograd convolution and its error against the direct loop
+static void report_winograd_layers(vector<Layer*> &layers) {
+        for(Layer *layer: layers) {
+                if(layer->type != LayerType::convolutional || ((ConvolutionalLayer*)layer)->engine != conv_winograd)
+                        continue;
+                ConvolutionalLayer *conv = (ConvolutionalLayer*)layer;
+                int m = conv->winograd_tile;
+                cout << "Winograd F(" << m << "x" << m << ",3x3) convolution: " << (float)conv->forward_multiplies(0) / conv->forward_multiplies(m)
+                     << "x fewer multiplies, max relative error " << conv->winograd_error() << " against the direct loop" << endl;
+        }
 }
 
 static void* tensarThreadFunc(void* v) {
-        vector<InputCase*> cases = readInputDataset(); // MNIST dataset
+        TrainingOptions *options = (TrainingOptions*)v;
+        IdxDataset *dataset = IdxDataset::open("train-images.idx3-ubyte", "train-labels.idx1-ubyte", {OUTPUT_WIDTH, OUTPUT_HEIGHT, OUTPUT_DEPTH}); // MNIST dataset
+        if(dataset == NULL)
+                exit(1);
+#ifndef TENSAR_HEADLESS
         currentInputTensorFrameBuffer = new TensorRenderFrameBuffer(INPUT_WIDTH, INPUT_HEIGHT); // frame buffer for rendering the current input tensor from MNIST dataset
+#endif
 
         /*** BEGIN: Simple Convolutional Neural Network topology model ***/
-        ConvolutionalLayer *cnn_layer1 = new ConvolutionalLayer(1, 5, 8, cases[0]->data->size); // 28 * 28 * 1 -> 24 * 24 * 8
+#if FIXED_SHAPE_LAYERS
+        typedef FixedConvolutionalLayer<INPUT_WIDTH, INPUT_HEIGHT, INPUT_DEPTH, 5, 1, 8> Conv1; // 28 * 28 * 1 -> 24 * 24 * 8
+        typedef FixedPoolLayer<Conv1::OUT_W, Conv1::OUT_H, 8, 2, 2> Pool1; // 24 * 24 * 8 -> 12 * 12 * 8
+        assert(dataset->input_size.width == INPUT_WIDTH && dataset->input_size.height == INPUT_HEIGHT && dataset->input_size.depth == INPUT_DEPTH);
+        ConvolutionalLayer *cnn_layer1 = new Conv1();
+        ReLuLayer *relu_layer1 = new ReLuLayer(cnn_layer1->output->size);
+        PoolLayer *pool_layer1 = new Pool1();
+        FullyConnectedLayer *fc_layer = new FixedFullyConnectedLayer<Pool1::OUT_W * Pool1::OUT_H * 8, OUTPUT_WIDTH>(pool_layer1->output->size, linear_activation);
+#else
+        ConvolutionalLayer *cnn_layer1 = new ConvolutionalLayer(1, 5, 8, dataset->input_size); // 28 * 28 * 1 -> 24 * 24 * 8
         ReLuLayer *relu_layer1 = new ReLuLayer(cnn_layer1->output->size); // 28 * 28 * 1 -> 24 * 24 * 8
         PoolLayer *pool_layer1 = new PoolLayer(2, 2, relu_layer1->output->size);
-        FullyConnectedLayer *fc_layer = new FullyConnectedLayer(pool_layer1->output->size, {OUTPUT_WIDTH, OUTPUT_HEIGHT, OUTPUT_DEPTH});
+        FullyConnectedLayer *fc_layer = new FullyConnectedLayer(pool_layer1->output->size, {OUTPUT_WIDTH, OUTPUT_HEIGHT, OUTPUT_DEPTH}, linear_activation);
+#endif
+        SoftmaxCrossEntropyLayer *loss_layer = new SoftmaxCrossEntropyLayer(fc_layer->output->size);
 
         layers.push_back(cnn_layer1);
         layers.push_back(relu_layer1);
         layers.push_back(pool_layer1);
         layers.push_back(fc_layer);
+        layers.push_back(loss_layer);
         /*** END: Simple Convolutional Neural Network topology model ***/
 
         /*** BEGIN: Yet another Convolutional Neural Network topology model ***/
 /*
-        ConvolutionalLayer *cnn_layer1 = new ConvolutionalLayer(1, 5, 8, cases[0]->data->size); // 28 * 28 * 1 -> 24 * 24 * 8
+        ConvolutionalLayer *cnn_layer1 = new ConvolutionalLayer(1, 5, 8, dataset->input_size); // 28 * 28 * 1 -> 24 * 24 * 8
         ReLuLayer *relu_layer1 = new ReLuLayer(cnn_layer1->output->size); // 28 * 28 * 1 -> 24 * 24 * 8
         PoolLayer *pool_layer1 = new PoolLayer(2, 2, relu_layer1->output->size);
         ConvolutionalLayer *cnn_layer2 = new ConvolutionalLayer(1, 3, 10, pool_layer1->output->size); // 28 * 28 * 1 -> 24 * 24 * 8
         ReLuLayer *relu_layer2 = new ReLuLayer(cnn_layer2->output->size); // 28 * 28 * 1 -> 24 * 24 * 8
         PoolLayer *pool_layer2 = new PoolLayer(2, 2, relu_layer2->output->size);
-        FullyConnectedLayer *fc_layer = new FullyConnectedLayer(pool_layer2->output->size, {OUTPUT_WIDTH, OUTPUT_HEIGHT, OUTPUT_DEPTH});
+        FullyConnectedLayer *fc_layer = new FullyConnectedLayer(pool_layer2->output->size, {OUTPUT_WIDTH, OUTPUT_HEIGHT, OUTPUT_DEPTH}, linear_activation);
+        SoftmaxCrossEntropyLayer *loss_layer = new SoftmaxCrossEntropyLayer(fc_layer->output->size);
 
         layers.push_back(cnn_layer1);
         layers.push_back(relu_layer1);
@@ -445,70 +588,117 @@ static void* tensarThreadFunc(void* v) {
         layers.push_back(relu_layer2);
         layers.push_back(pool_layer2);
         layers.push_back(fc_layer);
+        layers.push_back(loss_layer);
  */
         /*** END: Yet another Convolutional Neural Network topology model ***/
 
+        // before the trainers replicate the layers, replicas share the optimizer of their master
+        for(Layer *layer: layers)
+                layer->optimizer = options->optimizer;
+
+        report_winograd_layers(layers);
+
+        // layers are drawn as they are, network is what actually trains
+        vector<Layer*> network = CHANNELS_LAST ? use_channels_last(layers) : layers;
+        if(FUSE_LAYERS)
+                network = fuse_conv_relu_pool(network);
+
+        if(options->scaling > 0) {
+                benchmark_scaling(network, dataset, options->scaling, options->batch_size);
+                delete dataset;
+                return 0;
+        }
+
         float amse = 0;
-        float max_value = 0.0f;
-        TensorFloat* expected;
         TensorFloat* output;
 
+        DataParallelTrainer* trainer = (options->threads > 1) ? new DataParallelTrainer(network, options->threads, options->batch_size) : NULL;
+        HogwildTrainer* hogwild = (options->hogwild_threads > 0) ? new HogwildTrainer(network, options->hogwild_threads, train) : NULL;
+        Workspace* workspace = (trainer == NULL && hogwild == NULL) ? new Workspace(network, options->batch_size) : NULL; // temporaries of the training steps, planned once
+        int step = (hogwild != NULL) ? HOGWILD_CHUNK_SIZE : options->batch_size;
+        BatchLoader* loader = new BatchLoader(dataset, step, LOADER_QUEUE_SIZE); // shuffled batches prefetched on a background thread
+        int threads = (hogwild != NULL) ? options->hogwild_threads : options->threads;
+        chrono::steady_clock::time_point report_time = chrono::steady_clock::now();
+        long report_ep = 0;
+        long step_allocations = 0; // heap allocations inside the training steps since the last report
+        double report_loss = 0; // summed cross entropy of the samples trained since the last report
+
         cout << "Start training...\n";
         for(long ep = 0; ep < 100000;)
         {
-                for(int i=0; i<cases.size(); i++)
+                for(int i=0; i < loader->batches_per_epoch; i++)
                 {
+#ifndef TENSAR_HEADLESS
                         while(1) {
                           cout << "";
                           if(!paused)
                             break;
                         }
+#endif
 
-                        InputCase *input_case = cases[i];
+                        BatchSlot *batch = loader->next();
 
-                        // update the frame buffer with the current input values
-                        for(int x = 0; x < input_case->data->size.width; x++)
-                                for(int y = 0; y < input_case->data->size.height; y++)
-                                        for(int z = 0; z < input_case->data->size.depth; z++)
-                                        {
-                                                float value = input_case->data->get(x, y, z);
-                                                currentInputTensorFrameBuffer->set(x, y, (int)(value * 255));
-                                        }
-                        // render input case swapping the double buffers
-                        currentInputTensorFrameBuffer->swapBuffers();
+#ifndef TENSAR_HEADLESS
+                        // only the steps taking a snapshot write into the render buffers
+                        bool snapshot = snapshot_policy.due();
+                        for(int l = 0; l < network.size(); l++) {
+                                network[l]->snapshot = snapshot;
+                        }
+#endif
 
-                        // train the layers with the current input case
-                        float xerr = train(layers, input_case);
+                        long allocations = allocation_count();
+                        float xerr;
+                        if(hogwild != NULL) {
+                                // train the next HOGWILD_CHUNK_SIZE input cases asynchronously
+                                xerr = hogwild->train(batch->data, batch->expected);
+                        } else {
+                                // train the layers with the next batch of input cases at once
+                                xerr = (trainer != NULL) ? trainer->train(batch->data, batch->expected) : train(network, workspace, batch->data, batch->expected);
+                        }
+                        step_allocations += allocation_count() - allocations;
+                        if(hogwild != NULL)
+                                report_loss += hogwild->loss;
+                        else
+                                report_loss += (trainer != NULL) ? trainer->loss : ((SoftmaxCrossEntropyLayer*)network.back())->loss;
 
                         // Calculate the average error of the training
                         amse += xerr;
-                        ep++;
-                        iteration++;
+                        ep += step;
+                        iteration += step;
                         avg_error_percent = amse/iteration;
 
-                        expected = input_case->output;
-                        max_value = 0.0f;
-                        for(int e = 0; e < 10; e++)
-                          if(max_value < (*expected)(e, 0, 0)) {
-                            max_value = (*expected)(e, 0, 0);
-                            expected_label = e;
-                          }
-
-                        output = layers.back()->output;
-                        max_value = 0.0f;
-                        for(int o = 0; o < 10; o++)
-                          if(max_value < (*output)(o, 0, 0)) {
-                            max_value = (*output)(o, 0, 0);
-                            predicted_label = o;
-                          }
-
-                        if(ep % 1000 == 0) {
-                                cout << "case " << ep << " err=" << avg_error_percent << endl;
-
-                                expected = input_case->output;
+                        // the layers drawn and predicted_label are those of the first sample of the batch,
+                        // or in Hogwild mode of the last case trained by the layers of the calling thread
+                        int shown_case = (hogwild != NULL) ? hogwild->last_case : 0;
+                        expected_label = dataset->label(batch->cases[shown_case]);
+                        predicted_label = ((SoftmaxCrossEntropyLayer*)network.back())->predicted[0];
+
+#ifndef TENSAR_HEADLESS
+                        if(snapshot) {
+                                // update the frame buffer with the input values of the case drawn
+                                currentInputTensorFrameBuffer->set_values(batch->data->sample(shown_case), 255);
+                                // render input case swapping the double buffers
+                                currentInputTensorFrameBuffer->swapBuffers();
+                        }
+#endif
+                        loader->release();
+
+                        if(ep % 1000 < step) {
+                                chrono::steady_clock::time_point now = chrono::steady_clock::now();
+                                double seconds = chrono::duration<double>(now - report_time).count();
+                                cout << "case " << ep << " err=" << avg_error_percent << " loss=" << report_loss / (ep - report_ep) << " samples/s=" << (ep - report_ep) / seconds << " threads=" << threads;
+#ifdef TENSAR_COUNT_ALLOCATIONS
+                                cout << " step_allocations=" << step_allocations;
+#endif
+                                cout << endl;
+                                report_time = now;
+                                report_ep = ep;
+                                step_allocations = 0;
+                                report_loss = 0;
+
                                 cout << "Expected:\n";
                                 for(int e = 0; e < 10; e++) {
-                                        printf("[%i] %f\n", e, (*expected)(e, 0, 0)*100.0f);
+                                        printf("[%i] %f\n", e, e == expected_label ? 100.0f : 0.0f);
                                 }
 
                                 cout << "Output:\n";
@@ -519,14 +709,28 @@ static void* tensarThreadFunc(void* v) {
                         }
                 }
         }
+        delete trainer;
+        delete hogwild;
+        delete workspace;
+        delete loader;
         delete currentInputTensorFrameBuffer;
+        delete dataset;
         return 0;
 }
 
 int main(int argc, char *argv[]) {
 
+        TrainingOptions options = parse_options(argc, argv);
+
+#ifdef TENSAR_HEADLESS
+        tensarThreadFunc(&options);
+#else
+        if(options.scaling > 0) {
+                tensarThreadFunc(&options); // a benchmark, without window
+                return 0;
+        }
         pthread_t tensarThreadId;
-        pthread_create(&tensarThreadId, NULL, tensarThreadFunc, 0);
+        pthread_create(&tensarThreadId, NULL, tensarThreadFunc, &options);
 
         glutInit(&argc, argv);
         glutInitDisplayMode(GLUT_RGB);
@@ -542,6 +746,7 @@ int main(int argc, char *argv[]) {
         //glEnable(GL_LINE_SMOOTH);
 
         glutMainLoop();
+#endif
 
         return 0;
 }
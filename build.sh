@@ -4,12 +4,22 @@ mkdir out
 SDKROOT="$(xcrun --sdk macosx --show-sdk-path)"
 echo "Compiling tensor.cpp"
 g++ -std=c++11 -stdlib=libc++ -Ofast -isysroot ${SDKROOT} -Wno-deprecated -o out/tensor.cpp.o -c src/tensor.cpp
+echo "Compiling tensor_view.cpp"
+g++ -std=c++11 -stdlib=libc++ -Ofast -isysroot ${SDKROOT} -Wno-deprecated -o out/tensor_view.cpp.o -c src/tensor_view.cpp
 echo "Compiling tensor_float.cpp"
 g++ -std=c++11 -stdlib=libc++ -Ofast -isysroot ${SDKROOT} -Wno-deprecated -o out/tensor_float.cpp.o -c src/tensor_float.cpp
 echo "Compiling tensor_gradient.cpp"
 g++ -std=c++11 -stdlib=libc++ -Ofast -isysroot ${SDKROOT} -Wno-deprecated -o out/tensor_gradient.cpp.o -c src/tensor_gradient.cpp
-echo "Compiling gradient.cpp"
-g++ -std=c++11 -stdlib=libc++ -Ofast -isysroot ${SDKROOT} -Wno-deprecated -o out/gradient.cpp.o -c src/gradient.cpp
+echo "Compiling gemm.cpp"
+g++ -std=c++11 -stdlib=libc++ -Ofast -isysroot ${SDKROOT} -Wno-deprecated -o out/gemm.cpp.o -c src/gemm.cpp
+echo "Compiling im2col.cpp"
+g++ -std=c++11 -stdlib=libc++ -Ofast -isysroot ${SDKROOT} -Wno-deprecated -o out/im2col.cpp.o -c src/im2col.cpp
+echo "Compiling winograd.cpp"
+g++ -std=c++11 -stdlib=libc++ -Ofast -isysroot ${SDKROOT} -Wno-deprecated -o out/winograd.cpp.o -c src/winograd.cpp
+echo "Compiling activation.cpp"
+g++ -std=c++11 -stdlib=libc++ -Ofast -isysroot ${SDKROOT} -Wno-deprecated -o out/activation.cpp.o -c src/activation.cpp
+echo "Compiling optimizer.cpp"
+g++ -std=c++11 -stdlib=libc++ -Ofast -isysroot ${SDKROOT} -Wno-deprecated -o out/optimizer.cpp.o -c src/optimizer.cpp
 echo "Compiling layer.cpp"
 g++ -std=c++11 -stdlib=libc++ -Ofast -isysroot ${SDKROOT} -Wno-deprecated -o out/layer.cpp.o -c src/layer.cpp
 echo "Compiling convolutional_layer.cpp"
@@ -20,11 +30,35 @@ echo "Compiling pool_layer.cpp"
 g++ -std=c++11 -stdlib=libc++ -Ofast -isysroot ${SDKROOT} -Wno-deprecated -o out/pool_layer.cpp.o -c src/pool_layer.cpp
 echo "Compiling fully_connected_layer.cpp"
 g++ -std=c++11 -stdlib=libc++ -Ofast -isysroot ${SDKROOT} -Wno-deprecated -o out/fully_connected_layer.cpp.o -c src/fully_connected_layer.cpp
-echo "Compiling input_case.cpp"
-g++ -std=c++11 -stdlib=libc++ -Ofast -isysroot ${SDKROOT} -Wno-deprecated -o out/input_case.cpp.o -c src/input_case.cpp
+echo "Compiling conv_relu_pool_layer.cpp"
+g++ -std=c++11 -stdlib=libc++ -Ofast -isysroot ${SDKROOT} -Wno-deprecated -o out/conv_relu_pool_layer.cpp.o -c src/conv_relu_pool_layer.cpp
+echo "Compiling layout_conversion_layer.cpp"
+g++ -std=c++11 -stdlib=libc++ -Ofast -isysroot ${SDKROOT} -Wno-deprecated -o out/layout_conversion_layer.cpp.o -c src/layout_conversion_layer.cpp
+echo "Compiling fixed_shape_layers.cpp"
+g++ -std=c++11 -stdlib=libc++ -Ofast -isysroot ${SDKROOT} -Wno-deprecated -o out/fixed_shape_layers.cpp.o -c src/fixed_shape_layers.cpp
+echo "Compiling softmax_cross_entropy_layer.cpp"
+g++ -std=c++11 -stdlib=libc++ -Ofast -isysroot ${SDKROOT} -Wno-deprecated -o out/softmax_cross_entropy_layer.cpp.o -c src/softmax_cross_entropy_layer.cpp
+echo "Compiling workspace.cpp"
+g++ -std=c++11 -stdlib=libc++ -Ofast -isysroot ${SDKROOT} -Wno-deprecated -o out/workspace.cpp.o -c src/workspace.cpp
+echo "Compiling idx_dataset.cpp"
+g++ -std=c++11 -stdlib=libc++ -Ofast -isysroot ${SDKROOT} -Wno-deprecated -o out/idx_dataset.cpp.o -c src/idx_dataset.cpp
+echo "Compiling batch_loader.cpp"
+g++ -std=c++11 -stdlib=libc++ -Ofast -isysroot ${SDKROOT} -Wno-deprecated -o out/batch_loader.cpp.o -c src/batch_loader.cpp
+echo "Compiling thread_barrier.cpp"
+g++ -std=c++11 -stdlib=libc++ -Ofast -isysroot ${SDKROOT} -Wno-deprecated -o out/thread_barrier.cpp.o -c src/thread_barrier.cpp
+echo "Compiling data_parallel_trainer.cpp"
+g++ -std=c++11 -stdlib=libc++ -Ofast -isysroot ${SDKROOT} -Wno-deprecated -o out/data_parallel_trainer.cpp.o -c src/data_parallel_trainer.cpp
+echo "Compiling hogwild_trainer.cpp"
+g++ -std=c++11 -stdlib=libc++ -Ofast -isysroot ${SDKROOT} -Wno-deprecated -o out/hogwild_trainer.cpp.o -c src/hogwild_trainer.cpp
+echo "Compiling snapshot_policy.cpp"
+g++ -std=c++11 -stdlib=libc++ -Ofast -isysroot ${SDKROOT} -Wno-deprecated -o out/snapshot_policy.cpp.o -c src/snapshot_policy.cpp
 echo "Compiling tensor_render_frame_buffer.cpp"
 g++ -std=c++11 -stdlib=libc++ -Ofast -isysroot ${SDKROOT} -Wno-deprecated -o out/tensor_render_frame_buffer.cpp.o -c src/tensor_render_frame_buffer.cpp
 echo "Compiling layer_grid_frame_buffer.cpp"
 g++ -std=c++11 -stdlib=libc++ -Ofast -isysroot ${SDKROOT} -Wno-deprecated -o out/layer_grid_frame_buffer.cpp.o -c src/layer_grid_frame_buffer.cpp
+echo "Compiling surface_mesh.cpp"
+g++ -std=c++11 -stdlib=libc++ -Ofast -isysroot ${SDKROOT} -Wno-deprecated -o out/surface_mesh.cpp.o -c src/surface_mesh.cpp
 echo "Compiling NeuralNetwork"
-g++ -std=c++11 -stdlib=libc++ -Ofast out/input_case.cpp.o out/fully_connected_layer.cpp.o out/pool_layer.cpp.o out/tensor_gradient.cpp.o out/tensor_float.cpp.o out/tensor.cpp.o out/gradient.cpp.o out/tensor_render_frame_buffer.cpp.o NeuralNetworkMNIST.cpp out/layer_grid_frame_buffer.cpp.o -o tensar -isysroot ${SDKROOT} -Wl,-search_paths_first -Wl,-headerpad_max_install_names -framework OpenGL -framework GLUT -framework Cocoa -Wno-deprecated
+g++ -std=c++11 -stdlib=libc++ -Ofast out/idx_dataset.cpp.o out/fully_connected_layer.cpp.o out/pool_layer.cpp.o out/tensor_gradient.cpp.o out/tensor_float.cpp.o out/tensor.cpp.o out/tensor_render_frame_buffer.cpp.o NeuralNetworkMNIST.cpp out/layer_grid_frame_buffer.cpp.o -o tensar -isysroot ${SDKROOT} -Wl,-search_paths_first -Wl,-headerpad_max_install_names -framework OpenGL -framework GLUT -framework Cocoa -Wno-deprecated
+echo "Compiling NeuralNetwork (headless)"
+g++ -std=c++11 -stdlib=libc++ -Ofast -DTENSAR_HEADLESS NeuralNetworkMNIST.cpp -o tensar_headless -isysroot ${SDKROOT} -Wl,-search_paths_first -Wno-deprecated
@@ -0,0 +1,233 @@
+#ifndef _ACTIVATION_CPP
+#define _ACTIVATION_CPP
+
+#include <cstring>
+#include <cstdint>
+
+namespace NeuralNetwork {
+
+enum ActivationType { sigmoid_activation, tanh_activation, linear_activation };
+
+// Activation kernels over flat float arrays. They use GCC vector extensions, so the
+// compiler emits AVX-512, AVX2 / AVX or NEON / SSE code depending on the target flags
+// (e.g. -march=native); the tail of an array runs the same math on scalars.
+#if defined(__AVX512F__)
+#define ACTIVATION_VECTOR_WIDTH 16
+#elif defined(__AVX__)
+#define ACTIVATION_VECTOR_WIDTH 8
+#else
+#define ACTIVATION_VECTOR_WIDTH 4
+#endif
+
+// exp() is evaluated as 2^n * e^r with |r| <= ln(2) / 2 and a degree 5 polynomial for e^r
+// (Cephes expf coefficients). The relative error against exp() in double precision is
+// below 1e-7 over the clamped input range, below 4e-6 when built with -ffast-math.
+#define EXP_MIN_INPUT -87.0f // 2^n stays a normal float
+#define EXP_MAX_INPUT 88.0f
+#define EXP_LOG2E 1.44269504088896341f
+#define EXP_LN2_HI 0.693359375f // ln(2) split so that n * EXP_LN2_HI is exact
+#define EXP_LN2_LO -2.12194440e-4f
+
+static inline float fast_exp(float x)
+{
+        x = x < EXP_MIN_INPUT ? EXP_MIN_INPUT : (x > EXP_MAX_INPUT ? EXP_MAX_INPUT : x);
+        // n = floor(x * log2(e) + 0.5); no add and subtract rounding trick, -ffast-math would fold it
+        float fn = x * EXP_LOG2E + 0.5f;
+        int32_t k = (int32_t)fn;
+        k -= (float)k > fn;
+        float n = (float)k;
+        float r = x - n * EXP_LN2_HI - n * EXP_LN2_LO;
+
+        float p = 1.9875691500e-4f;
+        p = p * r + 1.3981999507e-3f;
+        p = p * r + 8.3334519073e-3f;
+        p = p * r + 4.1665795894e-2f;
+        p = p * r + 1.6666665459e-1f;
+        p = p * r + 5.0000001201e-1f;
+        p = p * r * r + r + 1.0f;
+
+        int32_t bits = (k + 127) << 23; // 2^n
+        float scale;
+        memcpy(&scale, &bits, sizeof(scale));
+        return p * scale;
+}
+
+static inline float fast_sigmoid(float x)
+{
+        return 1.0f / (1.0f + fast_exp(-x));
+}
+
+static inline float fast_tanh(float x)
+{
+        return 2.0f / (1.0f + fast_exp(-2.0f * x)) - 1.0f;
+}
+
+#if defined(__GNUC__)
+typedef float activation_vector __attribute__((vector_size(ACTIVATION_VECTOR_WIDTH * sizeof(float))));
+typedef int32_t activation_mask __attribute__((vector_size(ACTIVATION_VECTOR_WIDTH * sizeof(float))));
+
+static inline activation_vector activation_broadcast(float value)
+{
+        activation_vector v = {};
+        return v + value;
+}
+
+static inline activation_vector activation_load(const float *p)
+{
+        activation_vector v;
+        __builtin_memcpy(&v, p, sizeof(v));
+        return v;
+}
+
+static inline void activation_store(float *p, activation_vector v)
+{
+        __builtin_memcpy(p, &v, sizeof(v));
+}
+
+// Lanes of a where mask is set, of b elsewhere
+static inline activation_vector activation_select(activation_mask mask, activation_vector a, activation_vector b)
+{
+        return (activation_vector)(((activation_mask)a & mask) | ((activation_mask)b & ~mask));
+}
+
+static inline activation_vector fast_exp(activation_vector x)
+{
+        activation_vector lo = activation_broadcast(EXP_MIN_INPUT);
+        activation_vector hi = activation_broadcast(EXP_MAX_INPUT);
+        x = activation_select(x < lo, lo, x);
+        x = activation_select(x > hi, hi, x);
+        activation_vector fn = x * EXP_LOG2E + 0.5f;
+        activation_mask k = __builtin_convertvector(fn, activation_mask);
+        k += __builtin_convertvector(k, activation_vector) > fn; // true lanes are -1
+        activation_vector n = __builtin_convertvector(k, activation_vector);
+        activation_vector r = x - n * EXP_LN2_HI - n * EXP_LN2_LO;
+
+        activation_vector p = r * 1.9875691500e-4f + 1.3981999507e-3f;
+        p = p * r + 8.3334519073e-3f;
+        p = p * r + 4.1665795894e-2f;
+        p = p * r + 1.6666665459e-1f;
+        p = p * r + 5.0000001201e-1f;
+        p = p * r * r + r + 1.0f;
+
+        activation_mask bits = (k + 127) << 23;
+        return p * (activation_vector)bits;
+}
+#endif
+
+static void relu_forward(const float *__restrict in, float *__restrict out, int count)
+{
+        int i = 0;
+#if defined(__GNUC__)
+        activation_vector zero = activation_broadcast(0);
+        for(; i + ACTIVATION_VECTOR_WIDTH <= count; i += ACTIVATION_VECTOR_WIDTH) {
+                activation_vector x = activation_load(in + i);
+                activation_store(out + i, activation_select(x < zero, zero, x));
+        }
+#endif
+        for(; i < count; i++)
+                out[i] = in[i] < 0 ? 0 : in[i];
+}
+
+// in_grad = grad where the input was positive, 0 elsewhere
+static void relu_backward(const float *__restrict in, const float *__restrict grad, float *__restrict in_grad, int count)
+{
+        int i = 0;
+#if defined(__GNUC__)
+        activation_vector zero = activation_broadcast(0);
+        for(; i + ACTIVATION_VECTOR_WIDTH <= count; i += ACTIVATION_VECTOR_WIDTH)
+                activation_store(in_grad + i, activation_select(activation_load(in + i) < zero, zero, activation_load(grad + i)));
+#endif
+        for(; i < count; i++)
+                in_grad[i] = in[i] < 0 ? 0 : grad[i];
+}
+
+// in and out may be the same array
+static void sigmoid_forward(const float *in, float *out, int count)
+{
+        int i = 0;
+#if defined(__GNUC__)
+        for(; i + ACTIVATION_VECTOR_WIDTH <= count; i += ACTIVATION_VECTOR_WIDTH)
+                activation_store(out + i, 1.0f / (1.0f + fast_exp(-activation_load(in + i))));
+#endif
+        for(; i < count; i++)
+                out[i] = fast_sigmoid(in[i]);
+}
+
+// Derivative from the cached forward output: in_grad = grad * out * (1 - out)
+static void sigmoid_backward(const float *__restrict out, const float *__restrict grad, float *__restrict in_grad, int count)
+{
+        int i = 0;
+#if defined(__GNUC__)
+        for(; i + ACTIVATION_VECTOR_WIDTH <= count; i += ACTIVATION_VECTOR_WIDTH) {
+                activation_vector y = activation_load(out + i);
+                activation_store(in_grad + i, activation_load(grad + i) * y * (1.0f - y));
+        }
+#endif
+        for(; i < count; i++)
+                in_grad[i] = grad[i] * out[i] * (1.0f - out[i]);
+}
+
+// in and out may be the same array
+static void tanh_forward(const float *in, float *out, int count)
+{
+        int i = 0;
+#if defined(__GNUC__)
+        for(; i + ACTIVATION_VECTOR_WIDTH <= count; i += ACTIVATION_VECTOR_WIDTH)
+                activation_store(out + i, 2.0f / (1.0f + fast_exp(-2.0f * activation_load(in + i))) - 1.0f);
+#endif
+        for(; i < count; i++)
+                out[i] = fast_tanh(in[i]);
+}
+
+// Derivative from the cached forward output: in_grad = grad * (1 - out^2)
+static void tanh_backward(const float *__restrict out, const float *__restrict grad, float *__restrict in_grad, int count)
+{
+        int i = 0;
+#if defined(__GNUC__)
+        for(; i + ACTIVATION_VECTOR_WIDTH <= count; i += ACTIVATION_VECTOR_WIDTH) {
+                activation_vector y = activation_load(out + i);
+                activation_store(in_grad + i, activation_load(grad + i) * (1.0f - y * y));
+        }
+#endif
+        for(; i < count; i++)
+                in_grad[i] = grad[i] * (1.0f - out[i] * out[i]);
+}
+
+// Softmax of every row of classes floats; in and out may be the same array. The index of
+// the largest value of every row is stored in argmax unless it is NULL.
+static void softmax_forward(const float *in, float *out, int classes, int rows, int *argmax = NULL)
+{
+        for(int row = 0; row < rows; row++) {
+                const float *x = in + row * classes;
+                float *y = out + row * classes;
+                float max_value = x[0];
+                int max_index = 0;
+                for(int c = 1; c < classes; c++) {
+                        if(x[c] > max_value) {
+                                max_value = x[c];
+                                max_index = c;
+                        }
+                }
+                if(argmax != NULL)
+                        argmax[row] = max_index;
+
+                int i = 0;
+#if defined(__GNUC__)
+                for(; i + ACTIVATION_VECTOR_WIDTH <= classes; i += ACTIVATION_VECTOR_WIDTH)
+                        activation_store(y + i, fast_exp(activation_load(x + i) - max_value));
+#endif
+                for(; i < classes; i++)
+                        y[i] = fast_exp(x[i] - max_value);
+
+                float sum = 0;
+                for(int c = 0; c < classes; c++)
+                        sum += y[c];
+                float scale = 1.0f / sum;
+                for(int c = 0; c < classes; c++)
+                        y[c] *= scale;
+        }
+}
+
+}
+
+#endif
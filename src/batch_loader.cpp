@@ -0,0 +1,124 @@
+#ifndef _BATCH_LOADER_CPP
+#define _BATCH_LOADER_CPP
+
+#include <atomic>
+#include <vector>
+#include <thread>
+#include <random>
+#include <algorithm>
+#include "tensor_float.cpp"
+#include "idx_dataset.cpp"
+
+using namespace std;
+
+namespace NeuralNetwork {
+
+// A mini-batch assembled by the loader
+struct BatchSlot {
+        TensorFloat *data;
+        TensorFloat *expected;
+        vector<int> cases; // dataset index of every sample
+        int epoch;
+};
+
+// Prefetches mini-batches on a background thread. Every epoch visits the dataset in a new
+// random order; the batches are converted into a ring of preallocated slots which are
+// handed to the training thread through a single producer / single consumer queue. The
+// queue is lock-free: the producer only advances tail and the consumer only advances head.
+class BatchLoader {
+
+public:
+
+IdxDataset *dataset;
+int batch_size;
+int batches_per_epoch;
+vector<BatchSlot> slots;
+vector<int> order; // permutation of the current epoch
+mt19937 random;
+atomic<unsigned> head; // next slot to consume
+atomic<unsigned> tail; // next slot to fill
+atomic<bool> stopping;
+thread producer;
+
+BatchLoader(IdxDataset *dataset, int batch_size, int queue_size = 4, unsigned seed = 1) : random(seed) {
+        this->dataset = dataset;
+        this->batch_size = batch_size;
+        batches_per_epoch = dataset->case_count / batch_size;
+
+        size_tensor in_size = dataset->input_size;
+        size_tensor out_size = dataset->output_size;
+        slots = vector<BatchSlot>(queue_size);
+        for(BatchSlot &slot: slots) {
+                slot.data = new TensorFloat(in_size.width, in_size.height, in_size.depth, batch_size);
+                slot.expected = new TensorFloat(out_size.width, out_size.height, out_size.depth, batch_size);
+                slot.cases = vector<int>(batch_size);
+        }
+
+        order = vector<int>(dataset->case_count);
+        for(int i = 0; i < order.size(); i++) {
+                order[i] = i;
+        }
+
+        head = 0;
+        tail = 0;
+        stopping = false;
+        producer = thread(&BatchLoader::producer_loop, this);
+}
+
+// Returns the next batch, waiting only if the producer is behind. The slot stays owned
+// by the caller until release() is called.
+BatchSlot* next() {
+        unsigned h = head.load(memory_order_relaxed);
+        while(tail.load(memory_order_acquire) == h) {
+                this_thread::yield();
+        }
+        return &slots[h % slots.size()];
+}
+
+// Gives the slot returned by next() back to the producer
+void release() {
+        head.store(head.load(memory_order_relaxed) + 1, memory_order_release);
+}
+
+void producer_loop() {
+        for(int epoch = 0; ; epoch++) {
+                shuffle(order.begin(), order.end(), random);
+
+                for(int b = 0; b < batches_per_epoch; b++) {
+                        unsigned t = tail.load(memory_order_relaxed);
+                        while(t - head.load(memory_order_acquire) == slots.size()) {
+                                if(stopping)
+                                        return;
+                                this_thread::yield();
+                        }
+                        if(stopping)
+                                return;
+
+                        fill_slot(slots[t % slots.size()], &order[b * batch_size], epoch);
+                        tail.store(t + 1, memory_order_release);
+                }
+        }
+}
+
+void fill_slot(BatchSlot &slot, const int *cases, int epoch) {
+        for(int n = 0; n < batch_size; n++) {
+                dataset->fill_sample(cases[n], slot.data, slot.expected, n);
+                slot.cases[n] = cases[n];
+        }
+        slot.epoch = epoch;
+}
+
+~BatchLoader() {
+        stopping = true;
+        producer.join();
+        for(BatchSlot &slot: slots) {
+                delete slot.data;
+                delete slot.expected;
+        }
+}
+
+};
+
+}
+
+#endif
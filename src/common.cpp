@@ -1,13 +1,39 @@
 #ifndef _COMMON_CPP
 #define _COMMON_CPP
 
-#include "gradient.cpp"
+#include <cstdlib>
+#include <new>
+#include <atomic>
+#ifdef _WIN32
+#include <malloc.h>
+#endif
 
-namespace NeuralNetwork {
+// Define TENSAR_COUNT_ALLOCATIONS to count every heap allocation of the process, both
+// operator new and the aligned tensor arrays, e.g. to check that a training step allocates nothing.
+#ifdef TENSAR_COUNT_ALLOCATIONS
+static std::atomic<long> heap_allocations(0);
 
-#define LEARNING_RATE 0.02
-#define MOMENTUM 0.6
-#define WEIGHT_DECAY 0.001
+void* operator new(size_t size)
+{
+        heap_allocations.fetch_add(1, std::memory_order_relaxed);
+        void *ptr = malloc(size == 0 ? 1 : size);
+        if(ptr == NULL)
+                throw std::bad_alloc();
+        return ptr;
+}
+
+void operator delete(void *ptr) noexcept
+{
+        free(ptr);
+}
+
+void operator delete(void *ptr, size_t) noexcept
+{
+        free(ptr);
+}
+#endif
+
+namespace NeuralNetwork {
 
 struct point_tensor
 {
@@ -29,17 +55,81 @@ struct range_tensor
         int max_x, max_y, max_z;
 };
 
-static float update_weight(float w, Gradient* grad, float multp = 1)
+// Order of the values of a sample. Planar (NCHW) stores every channel as a width x height
+// map, channel-last (NHWC) stores the depth values of every position next to each other.
+// Both are the same for a single channel.
+enum TensorLayout { layout_nchw, layout_nhwc };
+
+// Outputs along one dimension of a window of extend_filter inputs sliding by stride over
+// in inputs with padding zeros on both sides. Inputs past the last whole stride are left out.
+static int window_outputs(int in, int extend_filter, int stride, int padding)
 {
-        float m = (grad->grad + grad->oldgrad * MOMENTUM);
-        w -= LEARNING_RATE * m * multp +
-             LEARNING_RATE * WEIGHT_DECAY * w;
-        return w;
+        return (in + 2 * padding - extend_filter) / stride + 1;
 }
 
-static void update_gradient(Gradient* grad)
+// Outputs [begin, end) of the out outputs whose input x * stride + offset lies in [0, in).
+// With the offsets of the first and the last window element, the intersection of both
+// ranges is the interior, where the windows need no bounds checks.
+static void inside_outputs(int offset, int in, int stride, int out, int &begin, int &end)
 {
-        grad->oldgrad = (grad->grad + grad->oldgrad * MOMENTUM);
+        begin = offset >= 0 ? 0 : (-offset + stride - 1) / stride;
+        end = offset >= in ? 0 : (in - offset - 1) / stride + 1;
+        begin = begin < out ? begin : out;
+        end = end < out ? end : out;
+        end = end > begin ? end : begin;
+}
+
+// Allocates float arrays on cache line boundaries, suitable for aligned vector loads
+#define TENSOR_ALIGNMENT 64
+
+static float* aligned_float_alloc(int count)
+{
+        void *ptr = NULL;
+#ifdef TENSAR_COUNT_ALLOCATIONS
+        heap_allocations.fetch_add(1, std::memory_order_relaxed);
+#endif
+#ifdef _WIN32
+        ptr = _aligned_malloc(count * sizeof(float), TENSOR_ALIGNMENT);
+#else
+        if(posix_memalign(&ptr, TENSOR_ALIGNMENT, count * sizeof(float)) != 0)
+                ptr = NULL;
+#endif
+        return (float*)ptr;
+}
+
+// Tells the compiler a pointer returned by aligned_float_alloc is aligned, so the loops
+// over it are vectorized with aligned loads and without peeling
+#if defined(__GNUC__)
+#define ASSUME_TENSOR_ALIGNED(ptr) ((decltype(ptr))__builtin_assume_aligned(ptr, TENSOR_ALIGNMENT))
+#else
+#define ASSUME_TENSOR_ALIGNED(ptr) (ptr)
+#endif
+
+static void aligned_float_free(float *ptr)
+{
+#ifdef _WIN32
+        _aligned_free(ptr);
+#else
+        free(ptr);
+#endif
+}
+
+// Rounds a number of floats up to whole cache lines, so consecutive arrays carved out of
+// one aligned block all start aligned
+static int aligned_count(int count)
+{
+        int line = TENSOR_ALIGNMENT / sizeof(float);
+        return (count + line - 1) / line * line;
+}
+
+// Heap allocations made so far, always 0 unless TENSAR_COUNT_ALLOCATIONS is defined
+static long allocation_count()
+{
+#ifdef TENSAR_COUNT_ALLOCATIONS
+        return heap_allocations.load(std::memory_order_relaxed);
+#else
+        return 0;
+#endif
 }
 
 }
@@ -0,0 +1,251 @@
+#ifndef _CONV_RELU_POOL_LAYER_CPP
+#define _CONV_RELU_POOL_LAYER_CPP
+
+#include <cassert>
+#include <cstdint>
+#include <algorithm>
+#include <vector>
+#include "layer.cpp"
+#include "tensor_float.cpp"
+#include "tensor_view.cpp"
+#include "gemm.cpp"
+#include "im2col.cpp"
+#include "convolutional_layer.cpp"
+#include "relu_layer.cpp"
+#include "pool_layer.cpp"
+
+namespace NeuralNetwork {
+
+#define FUSED_TILE_POSITIONS 256 // convolution outputs per filter computed at once, the tile stays in L1
+
+// Convolution, ReLU and max pooling run as one layer. The convolution of a band of
+// output rows is computed into a small tile, clamped and pooled while it is still in
+// L1, so the convolution and ReLU outputs are never written. A Winograd convolution
+// writes its output, which is then clamped and pooled in one pass. Backward only needs the
+// argmax of the pooling layer, set to POOL_NO_GRADIENT where the ReLU clamped the maximum.
+// The fused layer runs the three layers it replaces unfused on snapshot steps, so their
+// render buffers are refreshed as usual. Replicas own their three layers.
+class ConvReluPoolLayer : public Layer {
+
+public:
+
+ConvolutionalLayer *conv;
+ReLuLayer *relu;
+PoolLayer *pool;
+float *tile = NULL; // filters x tile positions convolution outputs, reserved by the Workspace
+int tile_pool_rows; // pooled output rows per tile
+bool fused_step = true; // false if the last activate() ran unfused
+
+ConvReluPoolLayer(ConvolutionalLayer *conv, ReLuLayer *relu, PoolLayer *pool) {
+        type = LayerType::conv_relu_pool;
+        this->conv = conv;
+        this->relu = relu;
+        this->pool = pool;
+        input_size = conv->input_size;
+        output_size = pool->output->size;
+        input_gradients = conv->input_gradients;
+        output = pool->output;
+
+        int conv_width = conv->output->size.width;
+        tile_pool_rows = max(1, (FUSED_TILE_POSITIONS / conv_width - pool->extend_filter) / pool->stride + 1);
+        tile_pool_rows = min(tile_pool_rows, output->size.height);
+}
+
+// True if the layers are a planar convolution, relu and unpadded pool of matching shapes
+static bool fusable(Layer *a, Layer *b, Layer *c) {
+        if(a->type != LayerType::convolutional || b->type != LayerType::relu || c->type != LayerType::pool)
+                return false;
+        if(a->layout != layout_nchw || b->layout != layout_nchw || c->layout != layout_nchw)
+                return false;
+        ConvolutionalLayer *conv = (ConvolutionalLayer*)a;
+        PoolLayer *pool = (PoolLayer*)c;
+        if(pool->padding != 0)
+                return false;
+        size_tensor conv_size = conv->output->size;
+        return b->input_size.width == conv_size.width && b->input_size.height == conv_size.height && b->input_size.depth == conv_size.depth &&
+               pool->input_size.width == conv_size.width && pool->input_size.height == conv_size.height && pool->input_size.depth == conv_size.depth;
+}
+
+Layer* replicate() {
+        ConvReluPoolLayer *replica = new ConvReluPoolLayer((ConvolutionalLayer*)conv->replicate(), (ReLuLayer*)relu->replicate(), (PoolLayer*)pool->replicate());
+        replica->master = this;
+        return replica;
+}
+
+void accumulate_gradients(Layer *replica) {
+        conv->accumulate_gradients(((ConvReluPoolLayer*)replica)->conv);
+}
+
+void set_batch_size(int n) {
+        batch_size = n;
+        conv->set_batch_size(n);
+        relu->set_batch_size(n);
+        pool->set_batch_size(n);
+}
+
+int workspace_size() {
+        int conv_width = conv->output->size.width;
+        int tile_rows = (tile_pool_rows - 1) * pool->stride + pool->extend_filter;
+        return aligned_count(conv->workspace_size()) + aligned_count(conv->filters.size() * tile_rows * conv_width);
+}
+
+void bind_workspace(float *scratch) {
+        conv->bind_workspace(scratch);
+        tile = scratch + aligned_count(conv->workspace_size());
+}
+
+void activate(const TensorView &in) {
+        if(in.batch != batch_size) {
+                set_batch_size(in.batch);
+        }
+        this->input = in;
+        conv->snapshot = relu->snapshot = pool->snapshot = snapshot;
+
+        fused_step = !snapshot;
+        if(fused_step) {
+                activate();
+        } else {
+                conv->activate(in);
+                relu->activate(conv->output->view());
+                pool->activate(relu->output->view());
+        }
+}
+
+void activate() {
+
+        int patch_size = conv->extend_filter * conv->extend_filter * input.size.depth;
+        int filter_count = conv->filters.size();
+        int conv_width = conv->output->size.width;
+        int conv_area = conv_width * conv->output->size.height;
+        int pool_extend = pool->extend_filter;
+        int pool_stride = pool->stride;
+        int pool_height = output->size.height;
+        assert(input.contiguous());
+
+        conv->input = input;
+
+        // the Winograd engine computes whole tiles of every filter, the maps are pooled once complete
+        if(conv->engine == conv_winograd) {
+                conv->activate();
+                for(int n = 0; n < batch_size; n++)
+                        relu_pool_rows(conv->output->sample(n), conv_area, n, 0, pool_height);
+                return;
+        }
+
+        conv->pack_filters();
+
+        for(int n = 0; n < batch_size; n++) {
+                float *sample_columns = &conv->columns[n * patch_size * conv_area];
+                im2col(input.sample(n), input.size, conv->extend_filter, conv->stride, conv->padding, conv_width, conv->output->size.height, sample_columns);
+
+                for(int first_row = 0; first_row < pool_height; first_row += tile_pool_rows) {
+                        int rows = min(tile_pool_rows, pool_height - first_row);
+                        int positions = ((rows - 1) * pool_stride + pool_extend) * conv_width;
+
+                        // convolution outputs of the conv rows seen by the pooled rows of the tile
+                        sgemm(false, false, filter_count, positions, patch_size,
+                              1.0f, conv->filter_matrix, patch_size, sample_columns + first_row * pool_stride * conv_width, conv_area,
+                              0.0f, tile, positions);
+
+                        relu_pool_rows(tile, positions, n, first_row, rows);
+                }
+        }
+
+}
+
+// Clamps and pools the pooled rows [first_row, first_row + rows) of sample n. The map of
+// filter f starts at maps + f * map_stride, on the first convolution row of the band.
+void relu_pool_rows(const float *maps, int map_stride, int n, int first_row, int rows) {
+
+        int conv_width = conv->output->size.width;
+        int pool_extend = pool->extend_filter;
+        int pool_stride = pool->stride;
+        int pool_width = output->size.width;
+        int pool_height = output->size.height;
+        float *pooled = output->sample(n);
+        uint8_t *sample_argmax = &pool->argmax[n * output->sample_size()];
+
+        for(int f = 0; f < conv->filters.size(); f++) {
+                const float *map = maps + f * map_stride;
+                for(int y = 0; y < rows; y++) {
+                        int out = (f * pool_height + first_row + y) * pool_width;
+                        for(int x = 0; x < pool_width; x++) {
+                                const float *window = map + y * pool_stride * conv_width + x * pool_stride;
+                                // branchless, the position of the maximum is unpredictable
+                                float best = 0; // ReLU
+                                int best_offset = POOL_NO_GRADIENT;
+                                for(int j = 0; j < pool_extend; j++) {
+                                        for(int i = 0; i < pool_extend; i++) {
+                                                float v = window[j * conv_width + i];
+                                                int greater = v > best;
+                                                best_offset += greater * (j * pool_extend + i - best_offset);
+                                                best = max(v, best);
+                                        }
+                                }
+                                pooled[out + x] = best;
+                                sample_argmax[out + x] = best_offset;
+                        }
+                }
+        }
+
+}
+
+void calc_grads(const TensorView &grad_next_layer) {
+
+        if(!fused_step) {
+                pool->calc_grads(grad_next_layer);
+                relu->calc_grads(pool->input_gradients->view());
+                conv->calc_grads(relu->input_gradients->view());
+                return;
+        }
+
+        // The pooled gradients go to the convolution outputs that were the maximum of their
+        // window, the relu input gradients tensor is free to hold them
+        TensorFloat *conv_gradients = relu->input_gradients;
+        pool->scatter_gradients(grad_next_layer, conv_gradients);
+
+        conv->calc_grads(conv_gradients->view());
+
+}
+
+void fix_weights() {
+        conv->fix_weights();
+}
+
+~ConvReluPoolLayer() {
+        if(master != NULL) {
+                delete conv;
+                delete relu;
+                delete pool;
+        }
+}
+
+};
+
+// Graph fusion pass: returns the layers to train, where every convolution followed by a
+// ReLU and a max pooling is replaced by a ConvReluPoolLayer, or by the fused layer of the
+// convolution if it has one. The given layers are left untouched, so they can still be drawn.
+static vector<Layer*> fuse_conv_relu_pool(const vector<Layer*> &layers)
+{
+        vector<Layer*> fused;
+        for(int i = 0; i < layers.size(); i++) {
+                Layer *layer = NULL;
+                if(i + 2 < layers.size() && ConvReluPoolLayer::fusable(layers[i], layers[i + 1], layers[i + 2])) {
+                        ConvolutionalLayer *conv = (ConvolutionalLayer*)layers[i];
+                        layer = conv->fuse_relu_pool((ReLuLayer*)layers[i + 1], (PoolLayer*)layers[i + 2]);
+                        if(layer == NULL && (conv->engine == conv_im2col_gemm || conv->engine == conv_winograd))
+                                layer = new ConvReluPoolLayer(conv, (ReLuLayer*)layers[i + 1], (PoolLayer*)layers[i + 2]);
+                }
+                if(layer != NULL) {
+                        fused.push_back(layer);
+                        i += 2;
+                } else {
+                        fused.push_back(layers[i]);
+                }
+        }
+        return fused;
+}
+
+}
+
+#endif
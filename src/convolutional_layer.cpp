@@ -4,14 +4,24 @@
 #include <cassert>
 #include <vector>
 #include <cmath>
+#include <cstring>
+#include <atomic>
 #include "layer.cpp"
 #include "tensor_gradient.cpp"
 #include "tensor_float.cpp"
+#include "gemm.cpp"
+#include "im2col.cpp"
+#include "winograd.cpp"
 #include "layer_grid_frame_buffer.cpp"
 #include "tensor_render_frame_buffer.cpp"
 
 namespace NeuralNetwork {
 
+enum ConvolutionEngine { conv_direct, conv_im2col_gemm, conv_fixed_shape, conv_winograd };
+
+class ReLuLayer;
+class PoolLayer;
+
 class ConvolutionalLayer : public Layer {
 
 public:
@@ -19,11 +29,33 @@ public:
 vector<TensorFloat*> filters;
 vector<TensorGradient*> filter_gradients;
 int stride, extend_filter;
+int padding; // zeros around every side of the input, (extend_filter - 1) / 2 keeps the input size with stride 1
+ConvolutionEngine engine = conv_im2col_gemm;
+// Scratch memory reserved by the Workspace, NULL until bind_workspace() is called
+float *columns = NULL; // im2col lowered input, reused for the input gradient columns in calc_grads
+float *filter_matrix = NULL; // filters packed as rows of the GEMM left operand
+float *filter_gradient_matrix = NULL; // GEMM output of the filter gradients
+float *winograd_tiles = NULL; // transformed input tile of every channel
+float *transformed_filters = NULL; // Winograd transform of the filters, computed by every replica
+int winograd_tile = 0; // output tile width m of the Winograd engine, 2 or 4
+unsigned transformed_version = 0; // weights_version the transformed filters were computed from
+atomic<unsigned> weights_version; // bumped when fix_weights() of the layer or of one of its replicas changes the filters
+
+// 3 x 3, stride 1 convolutions run on the Winograd engine, the others on im2col + GEMM
+ConvolutionalLayer(int stride, int extend_filter, int number_filters, size_tensor in_size, int padding = 0)
+        : ConvolutionalLayer(stride, extend_filter, number_filters, in_size, padding,
+                             extend_filter == 3 && stride == 1 ? conv_winograd : conv_im2col_gemm) {
+}
 
-ConvolutionalLayer(int stride, int extend_filter, int number_filters, size_tensor in_size) {
+// With the given engine, e.g. one of a derived class; conv_winograd picks its tile size
+ConvolutionalLayer(int stride, int extend_filter, int number_filters, size_tensor in_size, int padding, ConvolutionEngine engine) {
         type = LayerType::convolutional;
+        this->engine = engine;
         input_size = in_size;
+        int out_width = window_outputs(in_size.width, extend_filter, stride, padding);
+        int out_height = window_outputs(in_size.height, extend_filter, stride, padding);
 
+#ifndef TENSAR_HEADLESS
         //Define and alloc a grid layout for render buffers
 
         // {input, filter, gradient, output}
@@ -57,25 +89,23 @@ ConvolutionalLayer(int stride, int extend_filter, int number_filters, size_tenso
         // Initialize forth column of the grid with Output buffers
         gridRenderFrameBuffer->column_titles.push_back((char*)"out");
         subtitle = new char[50];
-        sprintf(subtitle, "%d x %d", (in_size.width - extend_filter) / stride + 1, (in_size.height - extend_filter) / stride + 1);
+        sprintf(subtitle, "%d x %d", out_width, out_height);
         gridRenderFrameBuffer->column_subtitles.push_back(subtitle);
 
         for(int i=0; i<number_filters; i++) {
-                gridRenderFrameBuffer->set(2, i, new TensorRenderFrameBuffer((in_size.width - extend_filter) / stride + 1, (in_size.height - extend_filter) / stride + 1));
+                gridRenderFrameBuffer->set(2, i, new TensorRenderFrameBuffer(out_width, out_height));
         }
+#endif
 
         input_gradients = new TensorFloat(in_size.width, in_size.height, in_size.depth);
-        input = new TensorFloat(in_size.width, in_size.height, in_size.depth);
-        output = new TensorFloat((in_size.width - extend_filter) / stride + 1, (in_size.height - extend_filter) / stride + 1, number_filters);
+        output = new TensorFloat(out_width, out_height, number_filters);
         this->stride = stride;
         this->extend_filter = extend_filter;
-        assert( (float( in_size.width - extend_filter ) / stride + 1) == ((in_size.width - extend_filter) / stride + 1) );
-        assert( (float( in_size.height - extend_filter ) / stride + 1) == ((in_size.height - extend_filter) / stride + 1) );
-
-        TensorRenderFrameBuffer* filterFrameBuffer;
+        this->padding = padding;
+        assert(padding >= 0 && padding < extend_filter); // every window sees at least one input
+        assert(out_width > 0 && out_height > 0);
 
         for(int a = 0; a < number_filters; a++) {
-                filterFrameBuffer = gridRenderFrameBuffer->get(1, a);
                 TensorFloat *filter = new TensorFloat(extend_filter, extend_filter, in_size.depth);
                 int maxval = extend_filter * extend_filter * in_size.depth;
 
@@ -87,206 +117,583 @@ ConvolutionalLayer(int stride, int extend_filter, int number_filters, size_tenso
                                 {
                                         float value = 1.0f / maxval * rand() / float( RAND_MAX );
                                         (*filter)(x, y, z) = value;
-                                        filterFrameBuffer->set(x, y, (int)(value * 255));
                                 }
                         }
                 }
 
                 filters.push_back(filter);
-                filterFrameBuffer->swapBuffers();
         }
 
         for(int i = 0; i < number_filters; i++) {
-                TensorGradient *tensorGradient = new TensorGradient(extend_filter, extend_filter, in_size.depth);
+                filter_gradients.push_back(new TensorGradient(extend_filter, extend_filter, in_size.depth));
+        }
 
-                // Update render frame gradients buffer values
-                for(int x = 0; x < extend_filter; x++)
-                {
-                        for(int y = 0; y < extend_filter; y++)
-                        {
-                                for(int z = 0; z < in_size.depth; z++)
-                                {
-                                        Gradient *gradient = tensorGradient->get(x, y, z);
-                                        float value = gradient->grad;
-                                }
-                        }
-                }
+        weights_version = 1;
+        if(engine == conv_winograd)
+                use_winograd(3 * forward_multiplies(4) < 2 * forward_multiplies(2) ? 4 : 2); // the 6 x 6 transforms cost more, so the 4 x 4 tiles must save a third of the products
 
-                filter_gradients.push_back(tensorGradient);
+        render_filters();
+}
+
+ConvolutionalLayer(ConvolutionalLayer *master_layer) {
+        type = LayerType::convolutional;
+        master = master_layer;
+        input_size = master_layer->input_size;
+        stride = master_layer->stride;
+        extend_filter = master_layer->extend_filter;
+        padding = master_layer->padding;
+        layout = master_layer->layout;
+        engine = master_layer->engine;
+        optimizer = master_layer->optimizer;
+        filters = master_layer->filters;
+        weights_version = 0; // replicas follow the version of their master
+        if(engine == conv_winograd)
+                use_winograd(master_layer->winograd_tile);
+
+        for(int i = 0; i < filters.size(); i++) {
+                filter_gradients.push_back(new TensorGradient(extend_filter, extend_filter, input_size.depth));
         }
 
+        input_gradients = new TensorFloat(input_size.width, input_size.height, input_size.depth, 1, layout);
+        output = new TensorFloat(master_layer->output->size.width, master_layer->output->size.height, master_layer->output->size.depth, 1, layout);
 }
 
-point_tensor map_to_input(point_tensor out, int z) {
-        out.x *= stride;
-        out.y *= stride;
-        out.z = z;
-        return out;
+Layer* replicate() {
+        return new ConvolutionalLayer(this);
 }
 
-int normalize_range(float f, int max, bool lim_min) {
-        if(f <= 0) { return 0; }
+// Multiplies of the forward pass of one sample: the elementwise tile products of the
+// Winograd engine with m x m output tiles, or those of the direct loop if m is 0
+long forward_multiplies(int m) {
+        long depth_filters = (long)input_size.depth * filters.size();
+        if(m == 0)
+                return (long)output->size.width * output->size.height * extend_filter * extend_filter * depth_filters;
+        long tiles = (long)((output->size.width + m - 1) / m) * ((output->size.height + m - 1) / m);
+        return tiles * (m + 2) * (m + 2) * depth_filters;
+}
 
-        max -= 1;
+// Switches a 3 x 3, stride 1 layer to the Winograd engine with m x m output tiles, before
+// the layer is bound to a Workspace
+void use_winograd(int m) {
+        assert(extend_filter == 3 && stride == 1 && (m == 2 || m == 4));
+        engine = conv_winograd;
+        winograd_tile = m;
+        transformed_version = 0;
+}
 
-        if(f >= max) { return max; }
+// Layer running this convolution, relu and pool fused, if the layer has its own fused
+// kernel. NULL leaves the choice to the fusion pass.
+virtual Layer* fuse_relu_pool(ReLuLayer*, PoolLayer*) {
+        return NULL;
+}
 
-        if(lim_min) {
-                // left side of inequality
-                return ceil( f );
-        } else {
-                return floor( f );
+void accumulate_gradients(Layer *replica) {
+        ConvolutionalLayer *conv_replica = (ConvolutionalLayer*)replica;
+        for(int k = 0; k < filter_gradients.size(); k++) {
+                float *grad = filter_gradients[k]->grad;
+                const float *replica_grad = conv_replica->filter_gradients[k]->grad;
+                for(int i = 0; i < filter_gradients[k]->count(); i++) {
+                        grad[i] += replica_grad[i];
+                }
         }
+        accumulated_samples += replica->accumulated_samples;
+}
+
+void set_batch_size(int n) {
+        batch_size = n;
+
+        *input_gradients = TensorFloat(input_size.width, input_size.height, input_size.depth, n, layout);
+        *output = TensorFloat(output->size.width, output->size.height, filters.size(), n, layout);
+        // too small for the new batch size until the workspace is planned again
+        columns = winograd_tiles = filter_matrix = filter_gradient_matrix = transformed_filters = NULL;
+}
+
+// Channel-last layers lower their input with im2row, so the GEMM writes channel-last outputs.
+// The Winograd engine gathers its tiles plane by plane and stays planar.
+bool set_layout(TensorLayout layout) {
+        if(layout == layout_nhwc && engine == conv_winograd)
+                return false;
+        this->layout = input_gradients->layout = output->layout = layout;
+        return true;
 }
 
+int winograd_workspace_size() {
+        return engine == conv_winograd ? (winograd_tile + 2) * (winograd_tile + 2) * input_size.depth : 0;
+}
+
+int transformed_filters_size() {
+        return engine == conv_winograd ? (winograd_tile + 2) * (winograd_tile + 2) * input_size.depth * filters.size() : 0;
+}
+
+int workspace_size() {
+        int patch_size = extend_filter * extend_filter * input_size.depth;
+        int out_area = output->size.width * output->size.height;
+        int lowered = max(patch_size * out_area * batch_size, winograd_workspace_size());
+        return aligned_count(lowered) + 2 * aligned_count(filters.size() * patch_size) + aligned_count(transformed_filters_size());
+}
+
+void bind_workspace(float *scratch) {
+        int patch_size = extend_filter * extend_filter * input_size.depth;
+        int out_area = output->size.width * output->size.height;
+        int lowered = max(patch_size * out_area * batch_size, winograd_workspace_size());
+        columns = scratch;
+        winograd_tiles = scratch; // the forward tiles are dead before calc_grads() lowers the input into the columns
+        filter_matrix = columns + aligned_count(lowered);
+        filter_gradient_matrix = filter_matrix + aligned_count(filters.size() * patch_size);
+        transformed_filters = engine == conv_winograd ? filter_gradient_matrix + aligned_count(filters.size() * patch_size) : NULL;
+        transformed_version = 0; // new memory, the filters are transformed again
+}
+
+// Input position of the first filter element of the window of an output, negative in the padding
+point_tensor map_to_input(point_tensor out, int z) {
+        out.x = out.x * stride - padding;
+        out.y = out.y * stride - padding;
+        out.z = z;
+        return out;
+}
+
+// First output whose window reaches the input position a
+int first_output(int a) {
+        int reach = a + padding - extend_filter + 1;
+        return reach <= 0 ? 0 : (reach + stride - 1) / stride;
+}
+
+// Outputs whose window covers the input (x, y). The range is empty, min > max, for the
+// trailing inputs that no window reaches.
 range_tensor map_to_output(int x, int y) {
-        float a = x;
-        float b = y;
         return {
-                       normalize_range( (a - extend_filter + 1) / stride, output->size.width, true ),
-                       normalize_range( (b - extend_filter + 1) / stride, output->size.height, true ),
+                       first_output(x),
+                       first_output(y),
                        0,
-                       normalize_range( a / stride, output->size.width, false ),
-                       normalize_range( b / stride, output->size.height, false ),
+                       min((x + padding) / stride, output->size.width - 1),
+                       min((y + padding) / stride, output->size.height - 1),
                        (int)filters.size() - 1,
         };
 }
 
-void activate(TensorFloat *in) {
+void activate(const TensorView &in) {
+        if(in.batch != batch_size) {
+                set_batch_size(in.batch);
+        }
         this->input = in;
+        if(snapshot)
+                render_input();
+        activate();
+}
 
-        // Update render frame inputs buffer values
+void activate() {
+
+        assert(input.layout == layout || input.size.depth == 1);
+        if(engine == conv_im2col_gemm && layout == layout_nhwc) {
+                activate_im2row_gemm();
+        } else if(engine == conv_im2col_gemm) {
+                activate_im2col_gemm();
+        } else if(engine == conv_winograd) {
+                activate_winograd();
+        } else {
+                activate_direct();
+        }
+
+        if(snapshot)
+                render_output();
+}
+
+// Update render frame inputs buffer values
+void render_input() {
+
+#ifndef TENSAR_HEADLESS
+        if(gridRenderFrameBuffer == NULL)
+                return;
+
+        const float *plane = input.values + (input.size.depth - 1) * input.plane_stride; // last channel of the first sample
         for(int filter = 0; filter < filters.size(); filter++)
         {
                 TensorRenderFrameBuffer* inputFrameBuffer = gridRenderFrameBuffer->get(0, filter);
-                for(int x = 0; x < in->size.width; x++)
-                {
-                        for(int y = 0; y < in->size.height; y++)
-                        {
-                                for(int z = 0; z < in->size.depth; z++)
-                                {
-                                        float value = in->get(x, y, z);
-                                        inputFrameBuffer->set(x, y, (int)(value * 255));
-                                }
-                        }
-                }
+                inputFrameBuffer->set_values(plane, 255, input.column_stride);
                 inputFrameBuffer->swapBuffers();
         }
-
-        activate();
+#endif
 }
 
-void activate() {
+// Update render frame outputs buffer values
+void render_output() {
+
+#ifndef TENSAR_HEADLESS
+        if(gridRenderFrameBuffer == NULL)
+                return;
 
+        TensorView out = output->view();
         for(int filter = 0; filter < filters.size(); filter++)
         {
                 TensorRenderFrameBuffer* outputFrameBuffer = gridRenderFrameBuffer->get(2, filter);
-                TensorFloat *filter_data = filters[filter];
-                for(int y = 0; y < output->size.height; y++)
+                outputFrameBuffer->set_values(out.values + filter * out.plane_stride, 255, out.column_stride);
+                outputFrameBuffer->swapBuffers();
+        }
+#endif
+}
+
+// Update render frame filters buffer values
+void render_filters() {
+
+#ifndef TENSAR_HEADLESS
+        if(gridRenderFrameBuffer == NULL)
+                return;
+
+        for(int k = 0; k < filters.size(); k++)
+        {
+                TensorRenderFrameBuffer* filterFrameBuffer = gridRenderFrameBuffer->get(1, k);
+                filterFrameBuffer->set_values(filters[k]->values + (input_size.depth - 1) * extend_filter * extend_filter, 512); // last channel
+                filterFrameBuffer->swapBuffers();
+        }
+#endif
+}
+
+void activate_direct() {
+
+        for(int n = 0; n < batch_size; n++)
+        {
+                for(int filter = 0; filter < filters.size(); filter++)
                 {
-                        for(int x = 0; x < output->size.width; x++)
+                        TensorFloat *filter_data = filters[filter];
+                        for(int y = 0; y < output->size.height; y++)
                         {
-                                point_tensor mapped = map_to_input( { (uint16_t)x, (uint16_t)y, 0 }, 0 );
-                                float sum = 0;
-                                for(int i = 0; i < extend_filter; i++)
+                                for(int x = 0; x < output->size.width; x++)
                                 {
-                                        for(int j = 0; j < extend_filter; j++)
+                                        point_tensor mapped = map_to_input( { x, y, 0 }, 0 );
+                                        float sum = 0;
+                                        for(int i = 0; i < extend_filter; i++)
                                         {
-                                                for(int z = 0; z < input->size.depth; z++)
+                                                for(int j = 0; j < extend_filter; j++)
                                                 {
-                                                        float f = (*filter_data)( i, j, z );
-                                                        float v = (*input)( mapped.x + i, mapped.y + j, z );
-                                                        sum += f*v;
+                                                        if(!input_inside(mapped.x + i, mapped.y + j))
+                                                                continue; // zero padding
+                                                        for(int z = 0; z < input.size.depth; z++)
+                                                        {
+                                                                float f = (*filter_data)( i, j, z );
+                                                                float v = input.get( mapped.x + i, mapped.y + j, z, n );
+                                                                sum += f*v;
+                                                        }
                                                 }
                                         }
+                                        output->get(x, y, filter, n) = sum;
                                 }
-                                (*output)(x, y, filter) = sum;
-                                outputFrameBuffer->set(x, y, (int)(sum * 255));
                         }
                 }
-                outputFrameBuffer->swapBuffers();
         }
 
 }
 
+bool input_inside(int x, int y) {
+        return x >= 0 && x < input_size.width && y >= 0 && y < input_size.height;
+}
+
+// Copies the filters into the rows of the GEMM filter operand, reordered as the im2row
+// windows with the channels innermost on channel-last layers
+void pack_filters() {
+
+        int depth = input_size.depth;
+        int area = extend_filter * extend_filter;
+        int patch_size = area * depth;
+        assert(columns != NULL); // the layer needs a Workspace planned for its batch size
+
+        for(int filter = 0; filter < filters.size(); filter++) {
+                float *row = &filter_matrix[filter * patch_size];
+                if(layout == layout_nhwc) {
+                        for(int z = 0; z < depth; z++)
+                                for(int e = 0; e < area; e++)
+                                        row[e * depth + z] = filters[filter]->values[z * area + e];
+                } else {
+                        memcpy(row, filters[filter]->values, patch_size * sizeof(float));
+                }
+        }
+
+}
+
+// Packs the filters and lowers every input sample into the columns
+void lower_input() {
+
+        int patch_size = extend_filter * extend_filter * input.size.depth;
+        int out_area = output->size.width * output->size.height;
+        assert(input.contiguous());
+
+        pack_filters();
+        for(int n = 0; n < batch_size; n++) {
+                im2col(input.sample(n), input.size, extend_filter, stride, padding, output->size.width, output->size.height, &columns[n * patch_size * out_area]);
+        }
+
+}
+
+// Lowers each input sample with im2col and computes all its output maps with a single
+// (filters x patch) * (patch x positions) matrix product.
+void activate_im2col_gemm() {
+
+        int patch_size = extend_filter * extend_filter * input.size.depth;
+        int out_area = output->size.width * output->size.height;
+        assert(input.contiguous());
+
+        pack_filters();
+
+        for(int n = 0; n < batch_size; n++) {
+                float *sample_columns = &columns[n * patch_size * out_area];
+                im2col(input.sample(n), input.size, extend_filter, stride, padding, output->size.width, output->size.height, sample_columns);
+                sgemm(false, false, filters.size(), out_area, patch_size,
+                      1.0f, filter_matrix, patch_size, sample_columns, out_area,
+                      0.0f, output->sample(n), out_area);
+        }
+
+}
+
+// Channel-last form of activate_im2col_gemm(): each input sample is lowered with im2row and
+// its output is the (positions x patch) * (patch x filters) product, the filters of every
+// position side by side. A single channel input is the same in both layouts and is lowered
+// with im2col, whose rows are much longer than the im2row runs of extend_filter values.
+void activate_im2row_gemm() {
+
+        int patch_size = extend_filter * extend_filter * input.size.depth;
+        int out_area = output->size.width * output->size.height;
+        bool planar = input.size.depth == 1;
+        assert(input.contiguous());
+
+        pack_filters();
+
+        for(int n = 0; n < batch_size; n++) {
+                float *sample_rows = &columns[n * patch_size * out_area];
+                if(planar)
+                        im2col(input.sample(n), input.size, extend_filter, stride, padding, output->size.width, output->size.height, sample_rows);
+                else
+                        im2row(input.sample(n), input.size, extend_filter, stride, padding, output->size.width, output->size.height, sample_rows);
+                sgemm(planar, true, out_area, filters.size(), patch_size,
+                      1.0f, sample_rows, planar ? out_area : patch_size, filter_matrix, patch_size,
+                      0.0f, output->sample(n), filters.size());
+        }
+
+}
+
+// Computes the output with Winograd F(m x m, 3 x 3) one tile at a time: the input tile of
+// every channel is transformed once and reused by all the filters.
+void activate_winograd() {
+        if(winograd_tile == 4) {
+                activate_winograd_tiles<4>();
+        } else {
+                activate_winograd_tiles<2>();
+        }
+}
+
+template<int M>
+void activate_winograd_tiles() {
+
+        const int AA = (M + 2) * (M + 2);
+        int depth = input.size.depth;
+        int out_width = output->size.width;
+        int out_height = output->size.height;
+        assert(input.contiguous());
+        assert(winograd_tiles != NULL && transformed_filters != NULL); // the layer needs a Workspace planned for its batch size
+        int filter_count = filters.size();
+
+        transform_filters<M>();
+
+        for(int n = 0; n < batch_size; n++) {
+                float *out = output->sample(n);
+                for(int y0 = 0; y0 < out_height; y0 += M) {
+                        for(int x0 = 0; x0 < out_width; x0 += M) {
+                                winograd_input<M>(input.sample(n), input.size, x0 - padding, y0 - padding, winograd_tiles);
+                                for(int k = 0; k < filter_count; k++)
+                                        winograd_output<M>(transformed_filters + k * depth * AA, winograd_tiles, depth, out + k * out_width * out_height, out_width, out_height, x0, y0);
+                        }
+                }
+        }
+
+}
+
+// Transforms the filters again only if fix_weights() changed them since the last time
+template<int M>
+void transform_filters() {
+        ConvolutionalLayer *owner = master != NULL ? (ConvolutionalLayer*)master : this;
+        unsigned version = owner->weights_version; // read first, an update racing with the transform is caught next time
+        if(version == transformed_version)
+                return;
+        int filter_count = filters.size();
+        for(int k = 0; k < filter_count; k++)
+                winograd_filter<M>(filters[k]->values, input_size.depth, transformed_filters + k * input_size.depth * (M + 2) * (M + 2));
+        transformed_version = version;
+}
+
+// Largest difference between the outputs of the Winograd engine and of the direct loop on
+// a random input, relative to the largest output. Must be called before the layer is
+// bound to a Workspace.
+float winograd_error() {
+        assert(engine == conv_winograd);
+        TensorFloat in(input_size.width, input_size.height, input_size.depth);
+        for(int i = 0; i < in.size.width * in.size.height * in.size.depth; i++)
+                in.values[i] = rand() / float( RAND_MAX );
+
+        set_batch_size(1);
+        float *scratch = aligned_float_alloc(workspace_size());
+        bind_workspace(scratch);
+        input = in.view();
+        activate_winograd();
+        vector<float> fast(output->values, output->values + output->sample_size());
+        activate_direct();
+
+        float error = 0, largest = 0;
+        for(int i = 0; i < fast.size(); i++) {
+                error = max(error, fabsf(fast[i] - output->values[i]));
+                largest = max(largest, fabsf(output->values[i]));
+        }
+
+        aligned_float_free(scratch);
+        columns = winograd_tiles = filter_matrix = filter_gradient_matrix = transformed_filters = NULL;
+        return error / largest;
+}
+
 void fix_weights() {
 
-        TensorRenderFrameBuffer* filterFrameBuffer;
+        float batch_scale = 1.0f / accumulated_samples; // mean gradient over the batch
         for(int k = 0; k < filters.size(); k++)
         {
-                filterFrameBuffer = gridRenderFrameBuffer->get(1, k);
-                for(int y = 0; y < extend_filter; y++)
-                {
-                        for(int x = 0; x < extend_filter; x++)
-                        {
-                                for(int z = 0; z < input->size.depth; z++)
-                                {
-                                        TensorFloat *filter = filters[k];
-                                        float& w = filter->get(x, y, z);
-                                        TensorGradient *tensor_gradient = filter_gradients[k];
-                                        Gradient *grad = tensor_gradient->get(x, y, z);
-                                        w = update_weight(w, grad);
-                                        update_gradient(grad);
-                                        filterFrameBuffer->set128(x, y, (int)((w * 128)/0.5f)); // signed value between -128 and 128
-                                }
-                        }
-                }
-                filterFrameBuffer->swapBuffers();
+                optimizer->update(filters[k]->values, filter_gradients[k], batch_scale);
         }
+        (master != NULL ? (ConvolutionalLayer*)master : this)->weights_version++;
 
+        if(snapshot)
+                render_filters();
 }
 
-void calc_grads(TensorFloat* grad_next_layer) {
+void calc_grads(const TensorView &grad_next_layer) {
+
+        if(engine == conv_winograd) {
+                lower_input(); // the Winograd forward leaves neither columns nor packed filters behind
+                calc_grads_im2col_gemm(grad_next_layer);
+        } else if(engine == conv_im2col_gemm && layout == layout_nhwc) {
+                calc_grads_im2row_gemm(grad_next_layer);
+        } else if(engine == conv_im2col_gemm) {
+                calc_grads_im2col_gemm(grad_next_layer);
+        } else {
+                calc_grads_direct(grad_next_layer);
+        }
+
+}
+
+void calc_grads_direct(const TensorView &grad_next_layer) {
 
         // Reset all layer gradients to 0
         for (int k = 0; k < filter_gradients.size(); k++) {
-                TensorGradient *gradient = filter_gradients[k]; //gradient->get(x, y, z).grad;
-
-                for ( int x = 0; x < extend_filter; x++ ) {
-                        for ( int y = 0; y < extend_filter; y++ ) {
-                                for ( int z = 0; z < input->size.depth; z++ ) {
-                                        gradient->get(x, y, z)->grad = 0;
-                                }
-                        }
-                }
+                filter_gradients[k]->clear();
         }
 
-        for(int x = 0; x < input->size.width; x++) {
-                for(int y = 0; y < input->size.height; y++) {
-                        range_tensor rn = map_to_output(x, y);
-                        for(int z = 0; z < input->size.depth; z++) {
-                                float sum_error = 0;
-                                for(int i = rn.min_x; i <= rn.max_x; i++) {
-                                        int minx = i * stride;
-                                        for(int j = rn.min_y; j <= rn.max_y; j++) {
-                                                int miny = j * stride;
-                                                for(int k = 0; k < filters.size(); k++) {
-                                                        TensorGradient *tensorGradient = filter_gradients[k];
-                                                        TensorFloat *tensorFilter = filters[k];
-                                                        int w_applied = tensorFilter->get( x - minx, y - miny, z );
-                                                        sum_error += w_applied * (*grad_next_layer)( i, j, k );
-                                                        float value = (*input)( x, y, z ) * (*grad_next_layer)( i, j, k );
-
-                                                        Gradient *gradient = tensorGradient->get(x - minx, y - miny, z);
-                                                        gradient->grad += value;
+        for(int n = 0; n < batch_size; n++) {
+                for(int x = 0; x < input.size.width; x++) {
+                        for(int y = 0; y < input.size.height; y++) {
+                                range_tensor rn = map_to_output(x, y);
+                                for(int z = 0; z < input.size.depth; z++) {
+                                        float sum_error = 0;
+                                        for(int i = rn.min_x; i <= rn.max_x; i++) {
+                                                int minx = i * stride - padding;
+                                                for(int j = rn.min_y; j <= rn.max_y; j++) {
+                                                        int miny = j * stride - padding;
+                                                        for(int k = 0; k < filters.size(); k++) {
+                                                                TensorGradient *tensorGradient = filter_gradients[k];
+                                                                TensorFloat *tensorFilter = filters[k];
+                                                                float w_applied = tensorFilter->get( x - minx, y - miny, z );
+                                                                sum_error += w_applied * grad_next_layer.get( i, j, k, n );
+                                                                float value = input.get( x, y, z, n ) * grad_next_layer.get( i, j, k, n );
+
+                                                                tensorGradient->grad[tensorGradient->index(x - minx, y - miny, z)] += value;
+                                                        }
                                                 }
                                         }
+                                        input_gradients->get(x, y, z, n) = sum_error;
                                 }
-                                (*input_gradients)(x, y, z) = sum_error;
                         }
                 }
         }
 
+        accumulated_samples = batch_size;
+
+}
+
+// Filter gradients are dY * columns^T and input gradients are col2im(W^T * dY), both
+// reusing the im2col columns and packed filters left behind by activate_im2col_gemm().
+void calc_grads_im2col_gemm(const TensorView &grad_next_layer) {
+
+        int patch_size = extend_filter * extend_filter * input.size.depth;
+        int out_area = output->size.width * output->size.height;
+
+        // Filter gradients are summed over the batch by accumulating into the same GEMM output
+        for(int n = 0; n < batch_size; n++) {
+                sgemm(false, true, filters.size(), patch_size, out_area,
+                      1.0f, grad_next_layer.sample(n), out_area, &columns[n * patch_size * out_area], out_area,
+                      n == 0 ? 0.0f : 1.0f, filter_gradient_matrix, patch_size);
+        }
+
+        for(int k = 0; k < filter_gradients.size(); k++) {
+                memcpy(filter_gradients[k]->grad, &filter_gradient_matrix[k * patch_size], patch_size * sizeof(float));
+        }
+
+        // The forward columns are no longer needed, so the input gradient columns overwrite them
+        for(int n = 0; n < batch_size; n++) {
+                float *sample_columns = &columns[n * patch_size * out_area];
+                sgemm(true, false, patch_size, out_area, filters.size(),
+                      1.0f, filter_matrix, patch_size, grad_next_layer.sample(n), out_area,
+                      0.0f, sample_columns, out_area);
+                col2im(sample_columns, extend_filter, stride, padding, output->size.width, output->size.height, input_gradients->sample(n), input.size);
+        }
+
+        accumulated_samples = batch_size;
+
+}
+
+// Channel-last form of calc_grads_im2col_gemm(): filter gradients are dY^T * rows and input
+// gradients are row2im(dY * W), dY holding the filters of every position side by side.
+void calc_grads_im2row_gemm(const TensorView &grad_next_layer) {
+
+        int depth = input.size.depth;
+        int area = extend_filter * extend_filter;
+        int patch_size = area * depth;
+        int out_area = output->size.width * output->size.height;
+        bool planar = depth == 1; // lowered with im2col
+        assert(grad_next_layer.contiguous() && (grad_next_layer.layout == layout_nhwc || grad_next_layer.size.depth == 1));
+
+        for(int n = 0; n < batch_size; n++) {
+                sgemm(true, planar, filters.size(), patch_size, out_area,
+                      1.0f, grad_next_layer.sample(n), filters.size(), &columns[n * patch_size * out_area], planar ? out_area : patch_size,
+                      n == 0 ? 0.0f : 1.0f, filter_gradient_matrix, patch_size);
+        }
+
+        // back to the planar order of the filters
+        for(int k = 0; k < filter_gradients.size(); k++) {
+                const float *row = &filter_gradient_matrix[k * patch_size];
+                for(int z = 0; z < depth; z++)
+                        for(int e = 0; e < area; e++)
+                                filter_gradients[k]->grad[z * area + e] = row[e * depth + z];
+        }
+
+        for(int n = 0; n < batch_size; n++) {
+                float *sample_rows = &columns[n * patch_size * out_area];
+                if(planar) {
+                        sgemm(true, true, patch_size, out_area, filters.size(),
+                              1.0f, filter_matrix, patch_size, grad_next_layer.sample(n), filters.size(),
+                              0.0f, sample_rows, out_area);
+                        col2im(sample_rows, extend_filter, stride, padding, output->size.width, output->size.height, input_gradients->sample(n), input.size);
+                } else {
+                        sgemm(false, false, out_area, patch_size, filters.size(),
+                              1.0f, grad_next_layer.sample(n), filters.size(), filter_matrix, patch_size,
+                              0.0f, sample_rows, patch_size);
+                        row2im(sample_rows, extend_filter, stride, padding, output->size.width, output->size.height, input_gradients->sample(n), input.size);
+                }
+        }
+
+        accumulated_samples = batch_size;
+
 }
 
 ~ConvolutionalLayer() {
-        for(int f=0; f<filters.size(); f++)
+        for(int f=0; master == NULL && f<filters.size(); f++)
                 delete filters[f];
 
         for(int i=0; i<filter_gradients.size(); i++)
                 delete filter_gradients[i];
         delete input_gradients;
-        delete input;
         delete output;
         delete gridRenderFrameBuffer;
 }
@@ -0,0 +1,175 @@
+#ifndef _DATA_PARALLEL_TRAINER_CPP
+#define _DATA_PARALLEL_TRAINER_CPP
+
+#include <cassert>
+#include <cstring>
+#include <vector>
+#include <thread>
+#include "layer.cpp"
+#include "tensor_float.cpp"
+#include "workspace.cpp"
+#include "thread_barrier.cpp"
+#include "softmax_cross_entropy_layer.cpp"
+
+using namespace std;
+
+namespace NeuralNetwork {
+
+// Splits every mini-batch in one slice per thread. Each thread runs the forward and
+// backward passes of its slice on its own replica of the layers, then the weight
+// gradients of the replicas are summed with a pairwise tree in a fixed order, so the
+// result is bit-reproducible for a given thread count, and one weights update is applied.
+class DataParallelTrainer {
+
+public:
+
+int thread_count;
+int batch_size;
+vector< vector<Layer*> > replicas; // replicas[0] are the layers given to the trainer
+vector<TensorFloat*> slice_data;
+vector<TensorFloat*> slice_expected;
+vector<Workspace*> workspaces; // per-step memory of every replica
+vector<int> slice_offset;
+vector<float> slice_error;
+vector<float> slice_loss;
+vector<thread> workers;
+ThreadBarrier barrier;
+TensorFloat *batch_data = NULL;
+TensorFloat *batch_expected = NULL;
+bool stopping = false;
+float loss = 0; // summed cross entropy of the samples of the last train()
+
+DataParallelTrainer(vector<Layer*> &layers, int thread_count, int batch_size) : barrier(thread_count) {
+        assert(thread_count >= 1 && batch_size >= thread_count);
+        assert(layers.back()->type == LayerType::softmax_cross_entropy);
+        this->thread_count = thread_count;
+        this->batch_size = batch_size;
+
+        size_tensor in_size = layers.front()->input_size;
+        size_tensor out_size = layers.back()->output->size;
+        int offset = 0;
+
+        for(int t = 0; t < thread_count; t++) {
+                if(t == 0) {
+                        replicas.push_back(layers);
+                } else {
+                        vector<Layer*> replica;
+                        for(Layer *layer: layers)
+                                replica.push_back(layer->replicate());
+                        replicas.push_back(replica);
+                }
+
+                int samples = batch_size / thread_count + (t < batch_size % thread_count ? 1 : 0);
+                slice_offset.push_back(offset);
+                slice_data.push_back(new TensorFloat(in_size.width, in_size.height, in_size.depth, samples));
+                slice_expected.push_back(new TensorFloat(out_size.width, out_size.height, out_size.depth, samples));
+                workspaces.push_back(new Workspace(replicas[t], samples));
+                slice_error.push_back(0);
+                slice_loss.push_back(0);
+                offset += samples;
+        }
+
+        // the weights may only change once the gradients of all the replicas are summed
+        for(int t = 0; t < thread_count; t++) {
+                for(Layer *layer: replicas[t])
+                        layer->deferred_update = true;
+        }
+
+        for(int t = 1; t < thread_count; t++) {
+                workers.push_back(thread(&DataParallelTrainer::worker_loop, this, t));
+        }
+}
+
+// Trains the layers with all the samples of the batch and returns the summed error %,
+// 100 per misclassified sample
+float train(TensorFloat *data, TensorFloat *expected) {
+        assert(data->batch == batch_size && expected->batch == batch_size);
+        batch_data = data;
+        batch_expected = expected;
+
+        barrier.wait(); // start
+        run_step(0);
+
+        vector<Layer*> &layers = replicas[0];
+        for(int i = 0; i < layers.size(); i++) {
+                layers[i]->fix_weights();
+        }
+
+        float err = 0;
+        loss = 0;
+        for(int t = 0; t < thread_count; t++) {
+                err += slice_error[t];
+                loss += slice_loss[t];
+        }
+        return err;
+}
+
+void worker_loop(int t) {
+        while(true) {
+                barrier.wait(); // start
+                if(stopping)
+                        return;
+                run_step(t);
+        }
+}
+
+void run_step(int t) {
+        train_slice(t);
+
+        // Tree reduction: at each level thread t adds the gradients of thread t + stride
+        for(int stride = 1; stride < thread_count; stride *= 2) {
+                barrier.wait();
+                if(t % (2 * stride) == 0 && t + stride < thread_count) {
+                        for(int i = 0; i < replicas[t].size(); i++) {
+                                replicas[t][i]->accumulate_gradients(replicas[t + stride][i]);
+                        }
+                }
+        }
+
+        barrier.wait(); // end
+}
+
+void train_slice(int t) {
+        TensorFloat *data = slice_data[t];
+        TensorFloat *expected = slice_expected[t];
+        vector<Layer*> &layers = replicas[t];
+
+        memcpy(data->values, batch_data->sample(slice_offset[t]), data->count() * sizeof(float));
+        memcpy(expected->values, batch_expected->sample(slice_offset[t]), expected->count() * sizeof(float));
+
+        for(int i = 0; i < layers.size(); i++) {
+                layers[i]->activate(i == 0 ? data->view() : layers[i - 1]->output->view());
+        }
+
+        // the loss layer takes the expected output in place of the next layer gradients
+        for(int i = layers.size() - 1; i >= 0; i--) {
+                layers[i]->calc_grads(i == layers.size() - 1 ? expected->view() : layers[i + 1]->input_gradients->view());
+        }
+
+        slice_error[t] = ((SoftmaxCrossEntropyLayer*)layers.back())->errors * 100.0f;
+        slice_loss[t] = ((SoftmaxCrossEntropyLayer*)layers.back())->loss;
+}
+
+~DataParallelTrainer() {
+        stopping = true;
+        barrier.wait();
+        for(int t = 0; t < workers.size(); t++) {
+                workers[t].join();
+        }
+
+        for(int t = 0; t < thread_count; t++) {
+                if(t > 0) {
+                        for(Layer *layer: replicas[t])
+                                delete layer;
+                }
+                delete slice_data[t];
+                delete slice_expected[t];
+                delete workspaces[t];
+        }
+}
+
+};
+
+}
+
+#endif
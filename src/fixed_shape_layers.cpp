@@ -0,0 +1,540 @@
+#ifndef _FIXED_SHAPE_LAYERS_CPP
+#define _FIXED_SHAPE_LAYERS_CPP
+
+#include <cassert>
+#include <cstdint>
+#include <cstring>
+#include <algorithm>
+#include "layer.cpp"
+#include "tensor_float.cpp"
+#include "tensor_view.cpp"
+#include "convolutional_layer.cpp"
+#include "relu_layer.cpp"
+#include "pool_layer.cpp"
+#include "fully_connected_layer.cpp"
+#include "conv_relu_pool_layer.cpp"
+#include "activation.cpp"
+
+namespace NeuralNetwork {
+
+// Layers whose shapes are template parameters, for topologies known at build time. They
+// are the runtime layers with their kernels replaced: every loop bound is a constant, so
+// the filter and window loops unroll and the accumulators of an output row stay in
+// registers. Rendering, replicas, trainers and workspaces see ordinary Layers.
+
+#define FIXED_FILTER_BLOCK 4 // filters sharing every input row load of the direct convolution
+#define FIXED_DOT_CHAINS 4 // independent vector accumulators of a dot product
+
+// Vector of N floats, GCC ignores a vector_size that depends on a template parameter
+template<int N> struct FixedVector;
+template<> struct FixedVector<1> { typedef float type __attribute__((vector_size(1 * sizeof(float)))); };
+template<> struct FixedVector<2> { typedef float type __attribute__((vector_size(2 * sizeof(float)))); };
+template<> struct FixedVector<4> { typedef float type __attribute__((vector_size(4 * sizeof(float)))); };
+template<> struct FixedVector<8> { typedef float type __attribute__((vector_size(8 * sizeof(float)))); };
+template<> struct FixedVector<16> { typedef float type __attribute__((vector_size(16 * sizeof(float)))); };
+
+// Row of W floats held in registers: the largest vectors up to ACTIVATION_VECTOR_WIDTH
+// lanes, then smaller ones for the rest (24 = 16 + 8 with AVX-512), so loads and stores
+// never touch the floats past the row.
+template<int W, int N = (W >= ACTIVATION_VECTOR_WIDTH ? ACTIVATION_VECTOR_WIDTH : W >= 8 ? 8 : W >= 4 ? 4 : W >= 2 ? 2 : 1)>
+struct FixedRow {
+
+typedef typename FixedVector<N>::type vector;
+
+vector head;
+FixedRow<W - N> tail;
+
+void clear() {
+        head = vector{};
+        tail.clear();
+}
+
+// row += weight * p[0 .. W - 1]
+void multiply_add(float weight, const float *p) {
+        vector v;
+        __builtin_memcpy(&v, p, sizeof(v));
+        head += weight * v;
+        tail.multiply_add(weight, p + N);
+}
+
+// row += other * p[0 .. W - 1]
+void multiply_add(const FixedRow &other, const float *p) {
+        vector v;
+        __builtin_memcpy(&v, p, sizeof(v));
+        head += other.head * v;
+        tail.multiply_add(other.tail, p + N);
+}
+
+void load(const float *p) {
+        __builtin_memcpy(&head, p, sizeof(head));
+        tail.load(p + N);
+}
+
+void store(float *p) const {
+        __builtin_memcpy(p, &head, sizeof(head));
+        tail.store(p + N);
+}
+
+float sum() const {
+        float total = tail.sum();
+        for(int i = 0; i < N; i++)
+                total += head[i];
+        return total;
+}
+
+};
+
+template<int N>
+struct FixedRow<0, N> {
+void clear() {}
+void multiply_add(float, const float*) {}
+template<class Row> void multiply_add(const Row&, const float*) {}
+void load(const float*) {}
+void store(float*) const {}
+float sum() const { return 0; }
+};
+
+// Unpadded convolutions only: the unrolled kernels read every window whole, and P, the
+// padding, is only there to reject padded shapes at compile time
+template<int IN_W, int IN_H, int IN_D, int K, int S, int F, int P = 0>
+class FixedConvolutionalLayer : public ConvolutionalLayer {
+
+public:
+
+static constexpr int INPUT_COUNT = IN_W * IN_H * IN_D;
+static constexpr int FILTERS = F;
+static constexpr int OUT_W = (IN_W - K) / S + 1;
+static constexpr int OUT_H = (IN_H - K) / S + 1;
+static constexpr int FILTER_BLOCK = F % FIXED_FILTER_BLOCK == 0 ? FIXED_FILTER_BLOCK : 1;
+static constexpr int PADDED_W = IN_W + K - 1; // output gradients rows with K - 1 zeros on both sides
+static constexpr int PADDED_H = IN_H + K - 1;
+static_assert((IN_W - K) % S == 0 && (IN_H - K) % S == 0, "the filter must tile the input");
+static_assert(P == 0, "fixed-shape convolutions are unpadded, use a ConvolutionalLayer for padding");
+
+FixedConvolutionalLayer() : ConvolutionalLayer(S, K, F, {IN_W, IN_H, IN_D}, 0, conv_fixed_shape) {
+}
+
+FixedConvolutionalLayer(FixedConvolutionalLayer *master_layer) : ConvolutionalLayer(master_layer) {
+}
+
+Layer* replicate() {
+        return new FixedConvolutionalLayer(this);
+}
+
+// The unrolled kernels are planar only
+bool set_layout(TensorLayout layout) {
+        return layout == layout_nchw;
+}
+
+Layer* fuse_relu_pool(ReLuLayer *relu, PoolLayer *pool);
+
+using ConvolutionalLayer::activate;
+
+float *padded_gradients = NULL; // F padded output gradient maps of one sample, reserved by the Workspace if the stride is 1
+
+// The direct kernels need no im2col columns
+int workspace_size() {
+        return S == 1 ? F * PADDED_H * PADDED_W : 0;
+}
+
+void bind_workspace(float *scratch) {
+        padded_gradients = S == 1 ? scratch : NULL;
+        if(padded_gradients != NULL)
+                memset(padded_gradients, 0, workspace_size() * sizeof(float));
+}
+
+void activate() {
+
+        assert(input.contiguous() && input.size.width == IN_W && input.size.height == IN_H && input.size.depth == IN_D);
+
+        for(int n = 0; n < batch_size; n++) {
+                for(int y = 0; y < OUT_H; y++) {
+                        for(int f = 0; f < F; f += FILTER_BLOCK) {
+                                float acc[FILTER_BLOCK][OUT_W];
+                                convolve_row(input.sample(n), f, y, acc);
+                                for(int b = 0; b < FILTER_BLOCK; b++)
+                                        memcpy(output->sample(n) + ((f + b) * OUT_H + y) * OUT_W, acc[b], OUT_W * sizeof(float));
+                        }
+                }
+        }
+
+        if(snapshot)
+                render_output();
+}
+
+// Output row y of the filters f .. f + FILTER_BLOCK - 1 of one sample
+void convolve_row(const float *sample, int f, int y, float acc[FILTER_BLOCK][OUT_W]) {
+
+        if(S == 1) {
+                FixedRow<OUT_W> rows[FILTER_BLOCK];
+                for(int b = 0; b < FILTER_BLOCK; b++)
+                        rows[b].clear();
+                for(int z = 0; z < IN_D; z++) {
+                        for(int j = 0; j < K; j++) {
+                                const float *row = sample + (z * IN_H + y + j) * IN_W;
+                                for(int i = 0; i < K; i++)
+                                        for(int b = 0; b < FILTER_BLOCK; b++)
+                                                rows[b].multiply_add(filters[f + b]->values[(z * K + j) * K + i], row + i);
+                        }
+                }
+                for(int b = 0; b < FILTER_BLOCK; b++)
+                        rows[b].store(acc[b]);
+                return;
+        }
+
+        for(int b = 0; b < FILTER_BLOCK; b++)
+                for(int x = 0; x < OUT_W; x++)
+                        acc[b][x] = 0;
+
+        for(int z = 0; z < IN_D; z++) {
+                for(int j = 0; j < K; j++) {
+                        const float *row = sample + (z * IN_H + y * S + j) * IN_W;
+                        for(int i = 0; i < K; i++) {
+                                for(int b = 0; b < FILTER_BLOCK; b++) {
+                                        float w = filters[f + b]->values[(z * K + j) * K + i];
+                                        for(int x = 0; x < OUT_W; x++)
+                                                acc[b][x] += w * row[x * S + i];
+                                }
+                        }
+                }
+        }
+}
+
+// Filter gradients: the K taps of a filter row sum their products over an output row in
+// registers. Input gradients: with stride 1 every input row is a full correlation of the
+// output gradients, zero padded in the workspace, with the flipped filters, accumulated
+// in registers like the forward rows. Other strides scatter every tap instead.
+void calc_grads(const TensorView &grad_next_layer) {
+
+        assert(grad_next_layer.contiguous());
+
+        for(int k = 0; k < F; k++)
+                filter_gradients[k]->clear();
+
+        for(int n = 0; n < batch_size; n++) {
+                const float *sample = input.sample(n);
+                const float *sample_dy = grad_next_layer.sample(n);
+                for(int f = 0; f < F; f++) {
+                        const float *dy = sample_dy + f * OUT_H * OUT_W;
+                        float *dw = filter_gradients[f]->grad;
+                        for(int z = 0; z < IN_D; z++) {
+                                for(int j = 0; j < K; j++) {
+                                        if(S == 1) {
+                                                FixedRow<OUT_W> acc[K];
+                                                for(int i = 0; i < K; i++)
+                                                        acc[i].clear();
+                                                for(int y = 0; y < OUT_H; y++) {
+                                                        FixedRow<OUT_W> dy_row;
+                                                        dy_row.load(dy + y * OUT_W);
+                                                        const float *row = sample + (z * IN_H + y + j) * IN_W;
+                                                        for(int i = 0; i < K; i++)
+                                                                acc[i].multiply_add(dy_row, row + i);
+                                                }
+                                                for(int i = 0; i < K; i++)
+                                                        dw[(z * K + j) * K + i] += acc[i].sum();
+                                                continue;
+                                        }
+                                        float acc[K][OUT_W] = {};
+                                        for(int y = 0; y < OUT_H; y++) {
+                                                const float *row = sample + (z * IN_H + y * S + j) * IN_W;
+                                                const float *dy_row = dy + y * OUT_W;
+                                                for(int i = 0; i < K; i++)
+                                                        for(int x = 0; x < OUT_W; x++)
+                                                                acc[i][x] += dy_row[x] * row[x * S + i];
+                                        }
+                                        for(int i = 0; i < K; i++) {
+                                                float sum = 0;
+                                                for(int x = 0; x < OUT_W; x++)
+                                                        sum += acc[i][x];
+                                                dw[(z * K + j) * K + i] += sum;
+                                        }
+                                }
+                        }
+                }
+
+                if(S == 1)
+                        correlate_gradients(sample_dy, input_gradients->sample(n));
+                else
+                        scatter_gradients(sample_dy, input_gradients->sample(n));
+        }
+
+        accumulated_samples = batch_size;
+
+}
+
+void correlate_gradients(const float *dy, float *gradients) {
+
+        assert(padded_gradients != NULL); // the layer needs a Workspace planned for its batch size
+
+        // the borders stay 0 from bind_workspace()
+        for(int f = 0; f < F; f++)
+                for(int y = 0; y < OUT_H; y++)
+                        memcpy(padded_gradients + (f * PADDED_H + y + K - 1) * PADDED_W + K - 1, dy + (f * OUT_H + y) * OUT_W, OUT_W * sizeof(float));
+
+        for(int z = 0; z < IN_D; z++) {
+                for(int y = 0; y < IN_H; y++) {
+                        FixedRow<IN_W> acc;
+                        acc.clear();
+                        for(int f = 0; f < F; f++) {
+                                const float *w = filters[f]->values + z * K * K;
+                                for(int j = 0; j < K; j++) {
+                                        const float *row = padded_gradients + (f * PADDED_H + y + K - 1 - j) * PADDED_W + K - 1;
+                                        for(int i = 0; i < K; i++)
+                                                acc.multiply_add(w[j * K + i], row - i);
+                                }
+                        }
+                        acc.store(gradients + (z * IN_H + y) * IN_W);
+                }
+        }
+}
+
+void scatter_gradients(const float *dy, float *gradients) {
+
+        memset(gradients, 0, IN_W * IN_H * IN_D * sizeof(float));
+        for(int f = 0; f < F; f++) {
+                const float *w = filters[f]->values;
+                for(int y = 0; y < OUT_H; y++) {
+                        const float *dy_row = dy + (f * OUT_H + y) * OUT_W;
+                        for(int z = 0; z < IN_D; z++) {
+                                for(int j = 0; j < K; j++) {
+                                        float *grad_row = gradients + (z * IN_H + y * S + j) * IN_W;
+                                        for(int i = 0; i < K; i++) {
+                                                float weight = w[(z * K + j) * K + i];
+                                                for(int x = 0; x < OUT_W; x++)
+                                                        grad_row[x * S + i] += weight * dy_row[x];
+                                        }
+                                }
+                        }
+                }
+        }
+}
+
+};
+
+template<int IN_W, int IN_H, int IN_D, int K, int S>
+class FixedPoolLayer : public PoolLayer {
+
+public:
+
+static constexpr int OUT_W = (IN_W - K) / S + 1;
+static constexpr int OUT_H = (IN_H - K) / S + 1;
+static_assert((IN_W - K) % S == 0 && (IN_H - K) % S == 0, "the window must tile the input");
+
+FixedPoolLayer() : PoolLayer(S, K, {IN_W, IN_H, IN_D}) {
+}
+
+FixedPoolLayer(FixedPoolLayer *master_layer) : PoolLayer(master_layer) {
+}
+
+Layer* replicate() {
+        return new FixedPoolLayer(this);
+}
+
+bool set_layout(TensorLayout layout) {
+        return layout == layout_nchw;
+}
+
+using PoolLayer::activate;
+
+void activate() {
+
+        assert(input.contiguous() && input.size.width == IN_W && input.size.height == IN_H && input.size.depth == IN_D);
+
+        for(int n = 0; n < batch_size; n++) {
+                const float *sample = input.sample(n);
+                float *pooled = output->sample(n);
+                uint8_t *sample_argmax = &argmax[n * OUT_W * OUT_H * IN_D];
+                for(int z = 0; z < IN_D; z++) {
+                        for(int y = 0; y < OUT_H; y++) {
+                                const float *rows = sample + (z * IN_H + y * S) * IN_W;
+                                int out = (z * OUT_H + y) * OUT_W;
+                                pool_row(rows, IN_W, pooled + out, sample_argmax + out, -INFINITY, 0);
+                        }
+                }
+        }
+
+        if(snapshot)
+                render_output();
+}
+
+// Pools the K rows starting at rows, row_stride floats apart, into one output row. Windows
+// whose maximum is not above floor output floor and floor_offset, which is how a fused
+// ReLU marks the windows it clamped.
+static void pool_row(const float *rows, int row_stride, float *pooled, uint8_t *offsets, float floor, int floor_offset) {
+
+        for(int x = 0; x < OUT_W; x++) {
+                // branchless, the position of the maximum is unpredictable
+                float best = floor;
+                int best_offset = floor_offset;
+                for(int j = 0; j < K; j++) {
+                        for(int i = 0; i < K; i++) {
+                                float v = rows[j * row_stride + x * S + i];
+                                int greater = v > best;
+                                best_offset += greater * (j * K + i - best_offset);
+                                best = std::max(v, best);
+                        }
+                }
+                pooled[x] = best;
+                offsets[x] = best_offset;
+        }
+}
+
+};
+
+// Conv -> ReLU -> Pool of fixed shapes: every pair of convolution rows seen by a pooled row
+// is computed in registers, clamped and pooled right away, so nothing but the pooled
+// outputs and their argmax is written.
+template<class Conv, int POOL_K, int POOL_S>
+class FixedConvReluPoolLayer : public ConvReluPoolLayer {
+
+public:
+
+typedef FixedPoolLayer<Conv::OUT_W, Conv::OUT_H, Conv::FILTERS, POOL_K, POOL_S> Pool;
+
+FixedConvReluPoolLayer(Conv *conv, ReLuLayer *relu, PoolLayer *pool) : ConvReluPoolLayer(conv, relu, pool) {
+}
+
+Layer* replicate() {
+        FixedConvReluPoolLayer *replica = new FixedConvReluPoolLayer((Conv*)conv->replicate(), (ReLuLayer*)relu->replicate(), (PoolLayer*)pool->replicate());
+        replica->master = this;
+        return replica;
+}
+
+using ConvReluPoolLayer::activate;
+
+int workspace_size() {
+        return conv->workspace_size();
+}
+
+void bind_workspace(float *scratch) {
+        conv->bind_workspace(scratch);
+}
+
+void activate() {
+
+        Conv *fixed_conv = (Conv*)conv;
+        assert(input.contiguous() && input.sample_size() == Conv::INPUT_COUNT);
+        conv->input = input;
+
+        for(int n = 0; n < batch_size; n++) {
+                float *pooled = output->sample(n);
+                uint8_t *sample_argmax = &pool->argmax[n * Pool::OUT_W * Pool::OUT_H * Conv::FILTERS];
+                for(int y = 0; y < Pool::OUT_H; y++) {
+                        for(int f = 0; f < Conv::FILTERS; f += Conv::FILTER_BLOCK) {
+                                float rows[POOL_K][Conv::FILTER_BLOCK][Conv::OUT_W];
+                                for(int j = 0; j < POOL_K; j++)
+                                        fixed_conv->convolve_row(input.sample(n), f, y * POOL_S + j, rows[j]);
+                                for(int b = 0; b < Conv::FILTER_BLOCK; b++) {
+                                        int out = ((f + b) * Pool::OUT_H + y) * Pool::OUT_W;
+                                        Pool::pool_row(rows[0][b], Conv::FILTER_BLOCK * Conv::OUT_W, pooled + out, sample_argmax + out, 0, POOL_NO_GRADIENT); // ReLU
+                                }
+                        }
+                }
+        }
+
+}
+
+};
+
+// Instantiates the fused layer only for convolution outputs the pooling window tiles
+template<class Conv, int POOL_K, int POOL_S, bool TILED = (Conv::OUT_W - POOL_K) % POOL_S == 0 && (Conv::OUT_H - POOL_K) % POOL_S == 0>
+struct FixedConvReluPoolFusion {
+static Layer* fuse(Conv*, ReLuLayer*, PoolLayer*) {
+        return NULL;
+}
+};
+
+template<class Conv, int POOL_K, int POOL_S>
+struct FixedConvReluPoolFusion<Conv, POOL_K, POOL_S, true> {
+static Layer* fuse(Conv *conv, ReLuLayer *relu, PoolLayer *pool) {
+        return new FixedConvReluPoolLayer<Conv, POOL_K, POOL_S>(conv, relu, pool);
+}
+};
+
+// Runs as a FixedConvReluPoolLayer if the pooling window is one of the usual fixed sizes
+template<int IN_W, int IN_H, int IN_D, int K, int S, int F, int P>
+Layer* FixedConvolutionalLayer<IN_W, IN_H, IN_D, K, S, F, P>::fuse_relu_pool(ReLuLayer *relu, PoolLayer *pool) {
+        if(pool->extend_filter == 2 && pool->stride == 2)
+                return FixedConvReluPoolFusion<FixedConvolutionalLayer, 2, 2>::fuse(this, relu, pool);
+        if(pool->extend_filter == 3 && pool->stride == 2)
+                return FixedConvReluPoolFusion<FixedConvolutionalLayer, 3, 2>::fuse(this, relu, pool);
+        return NULL;
+}
+
+// Fully connected layer of fixed shape: the dot products of a single sample run over a
+// constant number of inputs in vector accumulators. Batches and the backward pass, which
+// streams through the weights once, use the kernels of FullyConnectedLayer.
+template<int IN, int OUT>
+class FixedFullyConnectedLayer : public FullyConnectedLayer {
+
+public:
+
+static constexpr int ROW_STRIDE = (IN + TENSOR_ALIGNMENT / sizeof(float) - 1) / (TENSOR_ALIGNMENT / sizeof(float)) * (TENSOR_ALIGNMENT / sizeof(float));
+
+FixedFullyConnectedLayer(size_tensor in_size, ActivationType activation = sigmoid_activation) : FullyConnectedLayer(in_size, {OUT, 1, 1}, activation) {
+        assert(input_count == IN && row_stride == ROW_STRIDE);
+}
+
+FixedFullyConnectedLayer(FixedFullyConnectedLayer *master_layer) : FullyConnectedLayer(master_layer) {
+}
+
+Layer* replicate() {
+        return new FixedFullyConnectedLayer(this);
+}
+
+using FullyConnectedLayer::activate;
+
+void activate() {
+
+        if(batch_size != 1) {
+                FullyConnectedLayer::activate();
+                return;
+        }
+
+        assert(input.contiguous() && input.sample_size() == IN);
+        const float *x = input.values;
+        float *pre = output->values;
+        for(int n = 0; n < OUT; n++)
+                pre[n] = dot(x, weights->values + n * ROW_STRIDE);
+
+        if(activation == sigmoid_activation)
+                sigmoid_forward(pre, output->values, OUT);
+        else if(activation == tanh_activation)
+                tanh_forward(pre, output->values, OUT);
+
+        if(snapshot)
+                render_output();
+}
+
+// Dot product of IN floats in FIXED_DOT_CHAINS vector accumulators, then a FixedRow for the rest
+static float dot(const float *x, const float *w) {
+
+        typedef FixedVector<ACTIVATION_VECTOR_WIDTH>::type vector;
+        const int step = FIXED_DOT_CHAINS * ACTIVATION_VECTOR_WIDTH;
+        vector acc[FIXED_DOT_CHAINS] = {};
+        for(int m = 0; m < IN / step * step; m += step) {
+                for(int c = 0; c < FIXED_DOT_CHAINS; c++) {
+                        vector a, b;
+                        __builtin_memcpy(&a, x + m + c * ACTIVATION_VECTOR_WIDTH, sizeof(a));
+                        __builtin_memcpy(&b, w + m + c * ACTIVATION_VECTOR_WIDTH, sizeof(b));
+                        acc[c] += a * b;
+                }
+        }
+
+        FixedRow<IN % step> rest, rest_x;
+        rest.clear();
+        rest_x.load(x + IN / step * step);
+        rest.multiply_add(rest_x, w + IN / step * step);
+        float sum = rest.sum();
+        for(int c = 1; c < FIXED_DOT_CHAINS; c++)
+                acc[0] += acc[c];
+        for(int i = 0; i < ACTIVATION_VECTOR_WIDTH; i++)
+                sum += acc[0][i];
+        return sum;
+}
+
+};
+
+}
+
+#endif
@@ -3,26 +3,45 @@
 
 #include <vector>
 #include <cmath>
+#include <cstring>
+#include <cassert>
 #include "layer.cpp"
 #include "tensor_float.cpp"
+#include "tensor_gradient.cpp"
+#include "gemm.cpp"
+#include "activation.cpp"
 #include "layer_grid_frame_buffer.cpp"
 #include "tensor_render_frame_buffer.cpp"
 
 namespace NeuralNetwork {
 
+#define FC_LANES 8 // partial sums of a GEMV dot product, one vector register
+
+// Dense layer with sigmoid or tanh activation, whose derivative is computed from the cached
+// output, or linear when its outputs are the logits of a SoftmaxCrossEntropyLayer. The weights are
+// one row of inputs per output, every row padded to a cache line multiple so it starts
+// aligned: a single sample is a GEMV, a batch is a GEMM. Unless a trainer defers the update,
+// calc_grads updates every weight row right after computing its gradient, while the row is
+// still in cache.
 class FullyConnectedLayer : public Layer {
 
 public:
 
-TensorFloat *weights;
-vector<float> input_vector;
-vector<Gradient> gradients;
+TensorFloat *weights; // row stride x outputs, the padding columns are 0
+TensorGradient *weight_gradients; // same layout as weights
+int input_count; // inputs of a sample, the input tensor read as a flat vector
+int row_stride; // floats per weights row
+float *deltas = NULL; // batch x outputs deltas, reserved by the Workspace
+bool weights_updated = false; // calc_grads already applied the update of this step
+ActivationType activation;
 
-FullyConnectedLayer(size_tensor in_size, size_tensor out_size) {
+FullyConnectedLayer(size_tensor in_size, size_tensor out_size, ActivationType activation = sigmoid_activation) {
         type = LayerType::fc;
+        this->activation = activation;
         input_size = in_size;
         output_size = out_size;
 
+#ifndef TENSAR_HEADLESS
         //Define and alloc a grid layout for render buffers
 
         // {input, gradient, output}
@@ -52,65 +71,82 @@ FullyConnectedLayer(size_tensor in_size, size_tensor out_size) {
         sprintf(subtitle, "%d x %d", out_size.width, out_size.height);
         gridRenderFrameBuffer->column_subtitles.push_back(subtitle);
         gridRenderFrameBuffer->set(2, 0, new TensorRenderFrameBuffer(out_size.width, out_size.height));
+#endif
 
 
+        input_count = in_size.width * in_size.height * in_size.depth;
+        row_stride = aligned_count(input_count);
         input_gradients = new TensorFloat(in_size.width, in_size.height, in_size.depth);
-        gradients = vector<Gradient>(output_size.width);
-        input_vector = vector<float>(output_size.width);
-        input = new TensorFloat(in_size.width, in_size.height, in_size.depth);
         output = new TensorFloat(out_size.width, out_size.height, out_size.depth);
-        weights = new TensorFloat(in_size.width * in_size.height * in_size.depth, out_size.width, out_size.height);
+        weights = new TensorFloat(row_stride, out_size.width, 1);
+        weight_gradients = new TensorGradient(row_stride, out_size.width, 1);
+        memset(weights->values, 0, weights->count() * sizeof(float));
 
-        int maxval = in_size.width * in_size.height * in_size.depth;
+        int maxval = input_count;
 
         for(int i = 0; i < out_size.width; i++) {
-                for(int h = 0; h < in_size.width * in_size.height * in_size.depth; h++) {
-                        (*weights)(h, i, 0) = 2.19722f / maxval * rand() / float( RAND_MAX );
+                for(int h = 0; h < input_count; h++) {
+                        if(activation != sigmoid_activation)
+                                weights->values[i * row_stride + h] = (2.0f * rand() / float( RAND_MAX ) - 1.0f) / sqrtf(maxval); // outputs start close to 0
+                        else
+                                weights->values[i * row_stride + h] = 2.19722f / maxval * rand() / float( RAND_MAX );
                 }
         }
         // 2.19722f = f^-1(0.9) => x where [1 / (1 + exp(-x) ) = 0.9]
 
 }
 
-float activator_function(float x)
-{
-        //return tanhf( x );
-        float sig = 1.0f / (1.0f + exp( -x ));
-        return sig;
+FullyConnectedLayer(FullyConnectedLayer *master_layer) {
+        type = LayerType::fc;
+        master = master_layer;
+        activation = master_layer->activation;
+        optimizer = master_layer->optimizer;
+        input_size = master_layer->input_size;
+        output_size = master_layer->output_size;
+        input_count = master_layer->input_count;
+        row_stride = master_layer->row_stride;
+        weights = master_layer->weights;
+        weight_gradients = new TensorGradient(weights->size.width, weights->size.height, weights->size.depth);
+        input_gradients = new TensorFloat(input_size.width, input_size.height, input_size.depth);
+        output = new TensorFloat(output_size.width, output_size.height, output_size.depth);
 }
 
-float activator_derivative(float x)
-{
-        //float t = tanhf( x );
-        //return 1 - t * t;
-        float sig = 1.0f / (1.0f + exp( -x ));
-        return sig * (1 - sig);
+Layer* replicate() {
+        return new FullyConnectedLayer(this);
 }
 
-int map(point_tensor d)
-{
-        return d.z * (input->size.width * input->size.height) + d.y * (input->size.width) + d.x;
+void accumulate_gradients(Layer *replica) {
+        TensorGradient *replica_gradients = ((FullyConnectedLayer*)replica)->weight_gradients;
+        for(int i = 0; i < weight_gradients->count(); i++) {
+                weight_gradients->grad[i] += replica_gradients->grad[i];
+        }
+        accumulated_samples += replica->accumulated_samples;
 }
 
-void activate(TensorFloat *in) {
+void set_batch_size(int n) {
+        batch_size = n;
 
-        this->input = in;
+        *input_gradients = TensorFloat(input_size.width, input_size.height, input_size.depth, n);
+        *output = TensorFloat(output_size.width, output_size.height, output_size.depth, n);
+        deltas = NULL; // too small for the new batch size until the workspace is planned again
+}
 
-        // Update render frame inputs buffer values
-        TensorRenderFrameBuffer* inputFrameBuffer = gridRenderFrameBuffer->get(0, 0);
-        for(int x = 0; x < in->size.width; x++)
-        {
-                for(int y = 0; y < in->size.height; y++)
-                {
-                        for(int z = 0; z < in->size.depth; z++)
-                        {
-                                float value = in->get(x, y, z);
-                                inputFrameBuffer->set(x, y, (int)(value * 255));
-                        }
-                }
-        }
+int workspace_size() {
+        return batch_size * output_size.width;
+}
 
-        inputFrameBuffer->swapBuffers();
+void bind_workspace(float *scratch) {
+        deltas = scratch;
+}
+
+void activate(const TensorView &in) {
+
+        if(in.batch != batch_size) {
+                set_batch_size(in.batch);
+        }
+        this->input = in;
+        if(snapshot)
+                render_input();
 
         // Activate
         activate();
@@ -118,77 +154,141 @@ void activate(TensorFloat *in) {
 
 void activate() {
 
-        TensorRenderFrameBuffer* outputFrameBuffer = gridRenderFrameBuffer->get(2, 0);
-        for(int n = 0; n < output->size.width; n++)
-        {
-                float inputv = 0;
-                for(int i = 0; i < input->size.width; i++)
-                {
-                        for(int j = 0; j < input->size.height; j++)
-                        {
-                                for(int z = 0; z < input->size.depth; z++)
-                                {
-                                        int m = map( { i, j, z } );
-                                        inputv += (*input)(i, j, z) * (*weights)(m, n, 0);
-                                }
+        assert(input.contiguous() && input.sample_size() == input_count);
+        int out_count = output_size.width;
+        float *pre = output->values; // activated in place
+
+        if(batch_size == 1) {
+                // GEMV: FC_LANES independent partial sums per output, so the dot product vectorizes
+                const float *x = input.values;
+                for(int n = 0; n < out_count; n++) {
+                        const float *w = ASSUME_TENSOR_ALIGNED(weights->values + n * row_stride);
+                        float acc[FC_LANES] = {0};
+                        int m = 0;
+                        for(; m + FC_LANES <= input_count; m += FC_LANES) {
+                                for(int r = 0; r < FC_LANES; r++)
+                                        acc[r] += x[m + r] * w[m + r];
                         }
+                        float sum = 0;
+                        for(; m < input_count; m++)
+                                sum += x[m] * w[m];
+                        for(int r = 0; r < FC_LANES; r++)
+                                sum += acc[r];
+                        pre[n] = sum;
                 }
-
-                input_vector[n] = inputv;
-                float value = activator_function(inputv);
-                (*output)(n, 0, 0) = value;
-                outputFrameBuffer->set(n, 0, (int)(value * 255));
+        } else {
+                // GEMM: (batch x inputs) * (outputs x inputs)^T
+                sgemm(false, true, batch_size, out_count, input_count,
+                      1.0f, input.values, input_count, weights->values, row_stride,
+                      0.0f, pre, out_count);
         }
-        outputFrameBuffer->swapBuffers();
+
+        if(activation == sigmoid_activation)
+                sigmoid_forward(pre, output->values, batch_size * out_count);
+        else if(activation == tanh_activation)
+                tanh_forward(pre, output->values, batch_size * out_count);
+
+        if(snapshot)
+                render_output();
 }
 
-void fix_weights() {
+// Update render frame inputs buffer values
+void render_input() {
 
-        for(int n = 0; n < output->size.width; n++) {
+#ifndef TENSAR_HEADLESS
+        if(gridRenderFrameBuffer == NULL)
+                return;
 
-                Gradient &grad = gradients[n];
+        TensorRenderFrameBuffer* inputFrameBuffer = gridRenderFrameBuffer->get(0, 0);
+        inputFrameBuffer->set_values(input.values + (input.size.depth - 1) * input.size.width * input.size.height, 255); // last channel of the first sample
+        inputFrameBuffer->swapBuffers();
+#endif
+}
 
-                for(int i = 0; i < input->size.width; i++) {
-                        for(int j = 0; j < input->size.height; j++) {
-                                for(int z = 0; z < input->size.depth; z++) {
-                                        int m = map( { i, j, z } );
-                                        float &w = (*weights)(m, n, 0);
-                                        w = update_weight(w, &grad, (*input)(i, j, z));
-                                }
-                        }
-                }
+// Update render frame outputs buffer values
+void render_output() {
 
-                update_gradient(&grad);
-        }
+#ifndef TENSAR_HEADLESS
+        if(gridRenderFrameBuffer == NULL)
+                return;
 
+        TensorRenderFrameBuffer* outputFrameBuffer = gridRenderFrameBuffer->get(2, 0);
+        outputFrameBuffer->set_values(output->values, 255);
+        outputFrameBuffer->swapBuffers();
+#endif
 }
 
-void calc_grads(TensorFloat* grad_next_layer) {
+void fix_weights() {
+
+        if(!weights_updated) {
+                float batch_scale = 1.0f / accumulated_samples; // mean gradient over the batch
+                optimizer->update(weights->values, weight_gradients, batch_scale);
+        }
+        weights_updated = false;
+}
+
+void calc_grads(const TensorView &grad_next_layer) {
 
-        memset(input_gradients->values, 0, input_gradients->size.width * input_gradients->size.height * input_gradients->size.depth * sizeof(float));
-        for(int n = 0; n < output->size.width; n++)
-        {
-                Gradient& grad = gradients[n];
-                grad.grad = (*grad_next_layer)(n, 0, 0) * activator_derivative(input_vector[n]);
+        int out_count = output_size.width;
+        assert(deltas != NULL); // the layer needs a Workspace planned for its batch size
+        assert(grad_next_layer.contiguous());
 
-                for(int i = 0; i < input->size.width; i++) {
-                        for(int j = 0; j < input->size.height; j++) {
-                                for(int z = 0; z < input->size.depth; z++) {
-                                        int m = map( { i, j, z } );
-                                        (*input_gradients)(i, j, z) += grad.grad * (*weights)(m, n, 0);
-                                }
+        const float *delta_values = grad_next_layer.values; // linear: the deltas are the gradients
+        if(activation == sigmoid_activation) {
+                sigmoid_backward(output->values, grad_next_layer.values, deltas, batch_size * out_count);
+                delta_values = deltas;
+        } else if(activation == tanh_activation) {
+                tanh_backward(output->values, grad_next_layer.values, deltas, batch_size * out_count);
+                delta_values = deltas;
+        }
+
+        // The input gradients read every weight before its update, which is applied right
+        // away unless the gradients of replicas are summed first
+        weights_updated = !deferred_update;
+        float *in_grad = input_gradients->values;
+
+        if(batch_size == 1) {
+                // one pass per weights row: input gradients, weight gradients, then the update of the row
+                const float *x = input.values;
+                int step = weights_updated ? optimizer->begin_update(weight_gradients) : 0;
+                memset(in_grad, 0, input_count * sizeof(float));
+                for(int n = 0; n < out_count; n++) {
+                        float delta = delta_values[n];
+                        const float *w = ASSUME_TENSOR_ALIGNED(weights->values + n * row_stride);
+                        float *grad = ASSUME_TENSOR_ALIGNED(weight_gradients->grad + n * row_stride);
+                        for(int m = 0; m < input_count; m++) {
+                                in_grad[m] += delta * w[m];
+                                grad[m] = x[m] * delta;
+                        }
+                        if(weights_updated) {
+                                float *squares = weight_gradients->oldgrad_squares;
+                                optimizer->update_range(weights->values + n * row_stride, grad, weight_gradients->oldgrad + n * row_stride,
+                                                        squares == NULL ? NULL : squares + n * row_stride, input_count, 1.0f, step);
                         }
                 }
-
+        } else {
+                // input gradients = deltas * W and weight gradients = deltas^T * X
+                sgemm(false, false, batch_size, input_count, out_count,
+                      1.0f, delta_values, out_count, weights->values, row_stride,
+                      0.0f, in_grad, input_count);
+                sgemm(true, false, out_count, input_count, batch_size,
+                      1.0f, delta_values, out_count, input.values, input_count,
+                      0.0f, weight_gradients->grad, row_stride);
+                if(weights_updated)
+                        optimizer->update(weights->values, weight_gradients, 1.0f / batch_size);
         }
 
+        accumulated_samples = batch_size;
+
 }
 
 ~FullyConnectedLayer() {
 
         delete gridRenderFrameBuffer;
+        if(master == NULL)
+                delete weights;
+        delete weight_gradients;
         delete input_gradients;
-        delete input;
         delete output;
 }
 
@@ -0,0 +1,174 @@
+#ifndef _GEMM_CPP
+#define _GEMM_CPP
+
+#include <vector>
+#include <algorithm>
+
+namespace NeuralNetwork {
+
+// Cache blocking parameters. A MC x KC panel of A stays in L2 while a KC x NR
+// sliver of B streams through L1; the MR x NR tile of C lives in registers.
+#if defined(__AVX__)
+#define GEMM_VECTOR_WIDTH 8
+#else
+#define GEMM_VECTOR_WIDTH 4
+#endif
+
+#define GEMM_MR 4
+#define GEMM_NR (2 * GEMM_VECTOR_WIDTH)
+#define GEMM_MC 64
+#define GEMM_KC 256
+#define GEMM_NC 1024
+
+// Copies a mc x kc block of op(A) into MR-row slivers, zero padding the tail
+// sliver so the micro kernel never needs to check bounds.
+static void gemm_pack_a(int mc, int kc, const float *a, int row_stride, int col_stride, float *packed)
+{
+        for(int i = 0; i < mc; i += GEMM_MR) {
+                int mr = std::min(GEMM_MR, mc - i);
+                for(int p = 0; p < kc; p++) {
+                        for(int r = 0; r < mr; r++)
+                                packed[r] = a[(i + r) * row_stride + p * col_stride];
+                        for(int r = mr; r < GEMM_MR; r++)
+                                packed[r] = 0.0f;
+                        packed += GEMM_MR;
+                }
+        }
+}
+
+// Copies a kc x nc block of op(B) into NR-column slivers, zero padding the tail.
+static void gemm_pack_b(int kc, int nc, const float *b, int row_stride, int col_stride, float *packed)
+{
+        for(int j = 0; j < nc; j += GEMM_NR) {
+                int nr = std::min(GEMM_NR, nc - j);
+                for(int p = 0; p < kc; p++) {
+                        const float *row = b + p * row_stride + j * col_stride;
+                        if(col_stride == 1 && nr == GEMM_NR) {
+                                for(int c = 0; c < GEMM_NR; c++)
+                                        packed[c] = row[c];
+                        } else {
+                                for(int c = 0; c < nr; c++)
+                                        packed[c] = row[c * col_stride];
+                                for(int c = nr; c < GEMM_NR; c++)
+                                        packed[c] = 0.0f;
+                        }
+                        packed += GEMM_NR;
+                }
+        }
+}
+
+#if defined(__GNUC__)
+typedef float gemm_vector __attribute__((vector_size(GEMM_VECTOR_WIDTH * sizeof(float))));
+
+static inline gemm_vector gemm_load(const float *p)
+{
+        gemm_vector v;
+        __builtin_memcpy(&v, p, sizeof(v));
+        return v;
+}
+#endif
+
+// C[mr x nr] += alpha * A_sliver * B_sliver. The 4 x 2 vector accumulator tile
+// is held in registers for the whole kc loop.
+static void gemm_micro_kernel(int kc, float alpha, const float *__restrict a, const float *__restrict b,
+                              float *c, int ldc, int mr, int nr)
+{
+        float acc[GEMM_MR][GEMM_NR];
+
+#if defined(__GNUC__)
+        gemm_vector c00 = {0}, c01 = {0}, c10 = {0}, c11 = {0};
+        gemm_vector c20 = {0}, c21 = {0}, c30 = {0}, c31 = {0};
+
+        for(int p = 0; p < kc; p++) {
+                gemm_vector b0 = gemm_load(b);
+                gemm_vector b1 = gemm_load(b + GEMM_VECTOR_WIDTH);
+                c00 += a[0] * b0; c01 += a[0] * b1;
+                c10 += a[1] * b0; c11 += a[1] * b1;
+                c20 += a[2] * b0; c21 += a[2] * b1;
+                c30 += a[3] * b0; c31 += a[3] * b1;
+                a += GEMM_MR;
+                b += GEMM_NR;
+        }
+
+        __builtin_memcpy(&acc[0][0], &c00, sizeof(c00)); __builtin_memcpy(&acc[0][GEMM_VECTOR_WIDTH], &c01, sizeof(c01));
+        __builtin_memcpy(&acc[1][0], &c10, sizeof(c10)); __builtin_memcpy(&acc[1][GEMM_VECTOR_WIDTH], &c11, sizeof(c11));
+        __builtin_memcpy(&acc[2][0], &c20, sizeof(c20)); __builtin_memcpy(&acc[2][GEMM_VECTOR_WIDTH], &c21, sizeof(c21));
+        __builtin_memcpy(&acc[3][0], &c30, sizeof(c30)); __builtin_memcpy(&acc[3][GEMM_VECTOR_WIDTH], &c31, sizeof(c31));
+#else
+        for(int r = 0; r < GEMM_MR; r++)
+                for(int col = 0; col < GEMM_NR; col++)
+                        acc[r][col] = 0.0f;
+
+        for(int p = 0; p < kc; p++) {
+                for(int r = 0; r < GEMM_MR; r++) {
+                        float a_value = a[r];
+                        for(int col = 0; col < GEMM_NR; col++)
+                                acc[r][col] += a_value * b[col];
+                }
+                a += GEMM_MR;
+                b += GEMM_NR;
+        }
+#endif
+
+        for(int r = 0; r < mr; r++)
+                for(int col = 0; col < nr; col++)
+                        c[r * ldc + col] += alpha * acc[r][col];
+}
+
+// Single precision general matrix multiply on row-major matrices:
+// C = alpha * op(A) * op(B) + beta * C, where op(A) is m x k and op(B) is k x n.
+static void sgemm(bool trans_a, bool trans_b, int m, int n, int k,
+                  float alpha, const float *a, int lda, const float *b, int ldb,
+                  float beta, float *c, int ldc)
+{
+        for(int i = 0; i < m; i++) {
+                float *row = c + i * ldc;
+                if(beta == 0.0f) {
+                        for(int j = 0; j < n; j++) row[j] = 0.0f;
+                } else if(beta != 1.0f) {
+                        for(int j = 0; j < n; j++) row[j] *= beta;
+                }
+        }
+
+        if(k == 0 || alpha == 0.0f)
+                return;
+
+        int a_row_stride = trans_a ? 1 : lda;
+        int a_col_stride = trans_a ? lda : 1;
+        int b_row_stride = trans_b ? 1 : ldb;
+        int b_col_stride = trans_b ? ldb : 1;
+
+        // Packing buffers are kept per thread and reused across calls
+        thread_local std::vector<float> packed_a;
+        thread_local std::vector<float> packed_b;
+        packed_a.resize(GEMM_MC * GEMM_KC);
+        packed_b.resize(GEMM_KC * ((GEMM_NC + GEMM_NR - 1) / GEMM_NR) * GEMM_NR);
+
+        for(int jc = 0; jc < n; jc += GEMM_NC) {
+                int nc = std::min(GEMM_NC, n - jc);
+                for(int pc = 0; pc < k; pc += GEMM_KC) {
+                        int kc = std::min(GEMM_KC, k - pc);
+                        gemm_pack_b(kc, nc, b + pc * b_row_stride + jc * b_col_stride, b_row_stride, b_col_stride, packed_b.data());
+
+                        for(int ic = 0; ic < m; ic += GEMM_MC) {
+                                int mc = std::min(GEMM_MC, m - ic);
+                                gemm_pack_a(mc, kc, a + ic * a_row_stride + pc * a_col_stride, a_row_stride, a_col_stride, packed_a.data());
+
+                                for(int jr = 0; jr < nc; jr += GEMM_NR) {
+                                        int nr = std::min(GEMM_NR, nc - jr);
+                                        for(int ir = 0; ir < mc; ir += GEMM_MR) {
+                                                int mr = std::min(GEMM_MR, mc - ir);
+                                                gemm_micro_kernel(kc, alpha,
+                                                                  packed_a.data() + ir * kc,
+                                                                  packed_b.data() + jr * kc,
+                                                                  c + (ic + ir) * ldc + jc + jr, ldc, mr, nr);
+                                        }
+                                }
+                        }
+                }
+        }
+}
+
+}
+
+#endif
@@ -0,0 +1,144 @@
+#ifndef _HOGWILD_TRAINER_CPP
+#define _HOGWILD_TRAINER_CPP
+
+#include <atomic>
+#include <cstring>
+#include <vector>
+#include <thread>
+#include "layer.cpp"
+#include "tensor_float.cpp"
+#include "workspace.cpp"
+#include "thread_barrier.cpp"
+#include "softmax_cross_entropy_layer.cpp"
+
+using namespace std;
+
+namespace NeuralNetwork {
+
+typedef float (*TrainFunction)(vector<Layer*> &layers, Workspace *workspace, TensorFloat *data, TensorFloat *expected);
+
+// Asynchronous lock-free SGD (Hogwild). Every thread trains case by case on its own
+// replica of the layers and applies its weights updates straight to the weights shared
+// by all the replicas, without locks or reduction barriers. The worker threads persist
+// between calls and wait on a barrier, like those of the DataParallelTrainer.
+//
+// The data race on the weights is deliberate, and the only one. The optimizer updates
+// (fix_weights(), and FullyConnectedLayer::calc_grads() which updates its rows right away)
+// write the conv filters and the FC weights with plain stores while the forward and
+// backward kernels of the other replicas read them with plain loads, to compute outputs
+// and input gradients. The accesses are kept plain so those kernels stay vectorized; a
+// reader may mix old and new weights. Activations, gradients, momentum and workspaces
+// belong to a single replica.
+class HogwildTrainer {
+
+public:
+
+int thread_count;
+TrainFunction train_case;
+vector< vector<Layer*> > replicas; // replicas[0] are the layers given to the trainer
+vector<TensorFloat*> case_data; // single case tensors of every thread
+vector<TensorFloat*> case_expected;
+vector<Workspace*> workspaces; // per-step memory of every replica
+vector<float> thread_error;
+vector<float> thread_loss;
+atomic<int> next_case;
+int last_case = -1; // sample of the data tensor the layers given to the trainer trained last
+vector<thread> workers;
+ThreadBarrier barrier;
+TensorFloat *batch_data = NULL;
+TensorFloat *batch_expected = NULL;
+bool stopping = false;
+float loss = 0; // summed cross entropy of the cases of the last train()
+
+HogwildTrainer(vector<Layer*> &layers, int thread_count, TrainFunction train_case) : barrier(thread_count) {
+        this->thread_count = thread_count;
+        this->train_case = train_case;
+
+        replicas.push_back(layers);
+        for(int t = 1; t < thread_count; t++) {
+                vector<Layer*> replica;
+                for(Layer *layer: layers)
+                        replica.push_back(layer->replicate());
+                replicas.push_back(replica);
+        }
+        size_tensor in_size = layers.front()->input_size;
+        size_tensor out_size = layers.back()->output->size;
+        for(int t = 0; t < thread_count; t++) {
+                case_data.push_back(new TensorFloat(in_size.width, in_size.height, in_size.depth));
+                case_expected.push_back(new TensorFloat(out_size.width, out_size.height, out_size.depth));
+                workspaces.push_back(new Workspace(replicas[t], 1));
+        }
+        thread_error = vector<float>(thread_count);
+        thread_loss = vector<float>(thread_count);
+
+        for(int t = 1; t < thread_count; t++) {
+                workers.push_back(thread(&HogwildTrainer::worker_loop, this, t));
+        }
+}
+
+// Trains the samples of the data tensor one by one and returns the summed error %
+float train(TensorFloat *data, TensorFloat *expected) {
+        next_case = 0;
+        batch_data = data;
+        batch_expected = expected;
+
+        barrier.wait(); // start
+        train_cases(0);
+        barrier.wait(); // end
+
+        float err = 0;
+        loss = 0;
+        for(int t = 0; t < thread_count; t++) {
+                err += thread_error[t];
+                loss += thread_loss[t];
+        }
+        return err;
+}
+
+void worker_loop(int t) {
+        while(true) {
+                barrier.wait(); // start
+                if(stopping)
+                        return;
+                train_cases(t);
+                barrier.wait(); // end
+        }
+}
+
+// Trains the cases taken from the shared counter until none is left
+void train_cases(int t) {
+        thread_error[t] = 0;
+        thread_loss[t] = 0;
+        for(int n = next_case++; n < batch_data->batch; n = next_case++) {
+                memcpy(case_data[t]->values, batch_data->sample(n), batch_data->sample_size() * sizeof(float));
+                memcpy(case_expected[t]->values, batch_expected->sample(n), batch_expected->sample_size() * sizeof(float));
+                thread_error[t] += train_case(replicas[t], workspaces[t], case_data[t], case_expected[t]);
+                thread_loss[t] += ((SoftmaxCrossEntropyLayer*)replicas[t].back())->loss;
+                if(t == 0)
+                        last_case = n;
+        }
+}
+
+~HogwildTrainer() {
+        stopping = true;
+        barrier.wait();
+        for(int t = 0; t < workers.size(); t++) {
+                workers[t].join();
+        }
+
+        for(int t = 0; t < thread_count; t++) {
+                if(t > 0) {
+                        for(Layer *layer: replicas[t])
+                                delete layer;
+                }
+                delete case_data[t];
+                delete case_expected[t];
+                delete workspaces[t];
+        }
+}
+
+};
+
+}
+
+#endif
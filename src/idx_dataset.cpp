@@ -0,0 +1,203 @@
+#ifndef _IDX_DATASET_CPP
+#define _IDX_DATASET_CPP
+
+#include <cstdint>
+#include <cstring>
+#include <iostream>
+#include <fstream>
+#ifdef _WIN32
+#include <vector>
+#else
+#include <fcntl.h>
+#include <unistd.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#endif
+#include "common.cpp"
+#include "tensor_float.cpp"
+
+using namespace std;
+
+namespace NeuralNetwork {
+
+#define IDX_IMAGES_MAGIC 0x00000803 // unsigned byte, 3 dimensions
+#define IDX_LABELS_MAGIC 0x00000801 // unsigned byte, 1 dimension
+
+// Read-only view of a whole file. The file is memory mapped, so the pages are loaded
+// lazily by the kernel and shared with the page cache instead of copied to the heap.
+class MappedFile {
+
+public:
+
+const uint8_t *bytes = NULL;
+size_t size = 0;
+#ifdef _WIN32
+vector<uint8_t> buffer; // no mmap, the file is read at once
+#endif
+
+bool open(const char *path) {
+#ifdef _WIN32
+        ifstream file(path, ios::binary | ios::ate);
+        streamsize length = file.tellg();
+        if(length <= 0)
+                return false;
+        buffer.resize(length);
+        file.seekg(0, ios::beg);
+        file.read((char*)buffer.data(), length);
+        bytes = buffer.data();
+        size = length;
+#else
+        int fd = ::open(path, O_RDONLY);
+        if(fd < 0)
+                return false;
+
+        struct stat info;
+        if(fstat(fd, &info) != 0 || info.st_size <= 0) {
+                close(fd);
+                return false;
+        }
+
+        void *map = mmap(NULL, info.st_size, PROT_READ, MAP_PRIVATE, fd, 0);
+        close(fd);
+        if(map == MAP_FAILED)
+                return false;
+
+        madvise(map, info.st_size, MADV_WILLNEED);
+        bytes = (const uint8_t*)map;
+        size = info.st_size;
+#endif
+        return true;
+}
+
+~MappedFile() {
+#ifndef _WIN32
+        if(bytes != NULL)
+                munmap((void*)bytes, size);
+#endif
+}
+
+};
+
+// MNIST-like dataset stored in a pair of IDX files. The pixels and labels stay as the
+// bytes of the mapped files; cases are converted to normalized floats only when they
+// are copied into the input tensors of a training step.
+class IdxDataset {
+
+public:
+
+size_tensor input_size;
+size_tensor output_size;
+int case_count = 0;
+const uint8_t *images = NULL; // case_count images of input_size bytes, row major
+const uint8_t *labels = NULL; // case_count labels
+MappedFile images_file;
+MappedFile labels_file;
+
+// Maps both files and validates their headers, returns NULL if they are not a valid dataset
+static IdxDataset* open(const char *images_path, const char *labels_path, size_tensor output_size)
+{
+        IdxDataset *dataset = new IdxDataset();
+        dataset->output_size = output_size;
+        if(!dataset->load(images_path, labels_path)) {
+                delete dataset;
+                return NULL;
+        }
+        return dataset;
+}
+
+// Number of bytes of a single image
+int image_size() const
+{
+        return input_size.width * input_size.height * input_size.depth;
+}
+
+const uint8_t* image(int i) const
+{
+        assert(i >= 0 && i < case_count);
+        return images + (size_t)i * image_size();
+}
+
+int label(int i) const
+{
+        assert(i >= 0 && i < case_count);
+        return labels[i];
+}
+
+// Converts the case i into the sample n of the data and expected tensors
+void fill_sample(int i, TensorFloat *data, TensorFloat *expected, int n) const
+{
+        assert(data->sample_size() == image_size() && expected->sample_size() == output_size.width);
+
+        const uint8_t *__restrict src = image(i);
+        float *__restrict dst = data->sample(n);
+        int count = image_size();
+        const float scale = 1.0f / 255.0f;
+        for(int k = 0; k < count; k++) {
+                dst[k] = src[k] * scale;
+        }
+
+        float *one_hot = expected->sample(n);
+        memset(one_hot, 0, expected->sample_size() * sizeof(float));
+        one_hot[label(i)] = 1.0f;
+}
+
+private:
+
+static uint32_t read_big_endian_uint32(const uint8_t *p)
+{
+        return ((uint32_t)p[0] << 24) | ((uint32_t)p[1] << 16) | ((uint32_t)p[2] << 8) | (uint32_t)p[3];
+}
+
+bool load(const char *images_path, const char *labels_path)
+{
+        if(!images_file.open(images_path)) {
+                cerr << "Unable to open " << images_path << endl;
+                return false;
+        }
+        if(!labels_file.open(labels_path)) {
+                cerr << "Unable to open " << labels_path << endl;
+                return false;
+        }
+
+        if(images_file.size < 16 || read_big_endian_uint32(images_file.bytes) != IDX_IMAGES_MAGIC) {
+                cerr << images_path << " is not an IDX images file" << endl;
+                return false;
+        }
+        if(labels_file.size < 8 || read_big_endian_uint32(labels_file.bytes) != IDX_LABELS_MAGIC) {
+                cerr << labels_path << " is not an IDX labels file" << endl;
+                return false;
+        }
+
+        uint32_t image_count = read_big_endian_uint32(images_file.bytes + 4);
+        uint32_t rows = read_big_endian_uint32(images_file.bytes + 8);
+        uint32_t columns = read_big_endian_uint32(images_file.bytes + 12);
+        uint32_t label_count = read_big_endian_uint32(labels_file.bytes + 4);
+
+        if(image_count != label_count) {
+                cerr << images_path << " has " << image_count << " images but " << labels_path << " has " << label_count << " labels" << endl;
+                return false;
+        }
+        if(images_file.size < 16 + (size_t)image_count * rows * columns || labels_file.size < 8 + (size_t)label_count) {
+                cerr << "Truncated IDX dataset" << endl;
+                return false;
+        }
+
+        input_size = {(int)columns, (int)rows, 1};
+        case_count = image_count;
+        images = images_file.bytes + 16;
+        labels = labels_file.bytes + 8;
+
+        for(int i = 0; i < case_count; i++) {
+                if(labels[i] >= output_size.width) {
+                        cerr << "Label " << (int)labels[i] << " of case " << i << " out of range" << endl;
+                        return false;
+                }
+        }
+        return true;
+}
+
+};
+
+}
+
+#endif
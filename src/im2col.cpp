@@ -0,0 +1,156 @@
+#ifndef _IM2COL_CPP
+#define _IM2COL_CPP
+
+#include <cstring>
+#include <algorithm>
+#include "common.cpp"
+
+namespace NeuralNetwork {
+
+// Lowers an input sample into a (extend_filter * extend_filter * depth) x (out_width * out_height)
+// matrix. Row (z * extend_filter + j) * extend_filter + i holds the input pixel seen by the
+// filter element (i, j, z) at every output position, which matches the memory layout of
+// a filter TensorFloat, so every filter is one contiguous row of the left GEMM operand.
+// The input is zero padded by padding pixels on every side. The padding is written apart
+// from the copy of the interior, whose loop has no bounds checks.
+static void im2col(const float *in, size_tensor in_size, int extend_filter, int stride, int padding, int out_width, int out_height, float *columns)
+{
+        int out_area = out_width * out_height;
+        int in_area = in_size.width * in_size.height;
+
+        for(int z = 0; z < in_size.depth; z++) {
+                const float *plane = in + z * in_area;
+                for(int j = 0; j < extend_filter; j++) {
+                        int y_begin, y_end;
+                        inside_outputs(j - padding, in_size.height, stride, out_height, y_begin, y_end);
+                        for(int i = 0; i < extend_filter; i++) {
+                                int x_begin, x_end;
+                                inside_outputs(i - padding, in_size.width, stride, out_width, x_begin, x_end);
+
+                                float *row = columns + ((z * extend_filter + j) * extend_filter + i) * out_area;
+                                memset(row, 0, y_begin * out_width * sizeof(float));
+                                for(int y = y_begin; y < y_end; y++) {
+                                        const float *src = plane + (y * stride + j - padding) * in_size.width;
+                                        float *dst = row + y * out_width;
+                                        for(int x = 0; x < x_begin; x++)
+                                                dst[x] = 0;
+                                        if(stride == 1) {
+                                                for(int x = x_begin; x < x_end; x++)
+                                                        dst[x] = src[x + i - padding];
+                                        } else {
+                                                for(int x = x_begin; x < x_end; x++)
+                                                        dst[x] = src[x * stride + i - padding];
+                                        }
+                                        for(int x = x_end; x < out_width; x++)
+                                                dst[x] = 0;
+                                }
+                                memset(row + y_end * out_width, 0, (out_height - y_end) * out_width * sizeof(float));
+                        }
+                }
+        }
+}
+
+// Inverse of im2col: accumulates every column entry back into the input pixel it was
+// read from. Overlapping filter windows add up, which is what the input gradient needs.
+// Entries read from the padding are dropped.
+static void col2im(const float *columns, int extend_filter, int stride, int padding, int out_width, int out_height, float *in, size_tensor in_size)
+{
+        int out_area = out_width * out_height;
+        int in_area = in_size.width * in_size.height;
+
+        memset(in, 0, in_area * in_size.depth * sizeof(float));
+
+        for(int z = 0; z < in_size.depth; z++) {
+                float *plane = in + z * in_area;
+                for(int j = 0; j < extend_filter; j++) {
+                        int y_begin, y_end;
+                        inside_outputs(j - padding, in_size.height, stride, out_height, y_begin, y_end);
+                        for(int i = 0; i < extend_filter; i++) {
+                                int x_begin, x_end;
+                                inside_outputs(i - padding, in_size.width, stride, out_width, x_begin, x_end);
+
+                                const float *row = columns + ((z * extend_filter + j) * extend_filter + i) * out_area;
+                                for(int y = y_begin; y < y_end; y++) {
+                                        float *dst = plane + (y * stride + j - padding) * in_size.width;
+                                        const float *src = row + y * out_width;
+                                        if(stride == 1) {
+                                                for(int x = x_begin; x < x_end; x++)
+                                                        dst[x + i - padding] += src[x];
+                                        } else {
+                                                for(int x = x_begin; x < x_end; x++)
+                                                        dst[x * stride + i - padding] += src[x];
+                                        }
+                                }
+                        }
+                }
+        }
+}
+
+// Channel-last im2col: lowers a channel-last input sample into a (out_width * out_height) x
+// (extend_filter * extend_filter * depth) matrix. Row y * out_width + x holds the window of
+// the output (x, y), element (j * extend_filter + i) * depth + z, so every window row is a
+// single run of extend_filter * depth input values, and the GEMM writes channel-last
+// outputs. The runs are clipped to the input, the padding is written as zeros.
+static void im2row(const float *in, size_tensor in_size, int extend_filter, int stride, int padding, int out_width, int out_height, float *rows)
+{
+        int depth = in_size.depth;
+        int run = extend_filter * depth;
+        int patch_size = extend_filter * run;
+
+        for(int y = 0; y < out_height; y++) {
+                int y0 = y * stride - padding;
+                for(int x = 0; x < out_width; x++) {
+                        int x0 = x * stride - padding;
+                        int begin = std::max(0, -x0) * depth;
+                        int end = std::min(extend_filter, in_size.width - x0) * depth;
+                        float *dst = rows + (y * out_width + x) * patch_size;
+                        for(int j = 0; j < extend_filter; j++, dst += run) {
+                                int in_y = y0 + j;
+                                if(in_y < 0 || in_y >= in_size.height) {
+                                        memset(dst, 0, run * sizeof(float));
+                                        continue;
+                                }
+                                int src = (in_y * in_size.width + x0) * depth; // offset of the run, before the row if x0 < 0
+                                for(int k = 0; k < begin; k++)
+                                        dst[k] = 0;
+                                for(int k = begin; k < end; k++)
+                                        dst[k] = in[src + k];
+                                for(int k = end; k < run; k++)
+                                        dst[k] = 0;
+                        }
+                }
+        }
+}
+
+// Inverse of im2row: accumulates every window element back into the channel-last input it
+// was read from, dropping the padding.
+static void row2im(const float *rows, int extend_filter, int stride, int padding, int out_width, int out_height, float *in, size_tensor in_size)
+{
+        int depth = in_size.depth;
+        int run = extend_filter * depth;
+        int patch_size = extend_filter * run;
+
+        memset(in, 0, in_size.width * in_size.height * depth * sizeof(float));
+
+        for(int y = 0; y < out_height; y++) {
+                int y0 = y * stride - padding;
+                for(int x = 0; x < out_width; x++) {
+                        int x0 = x * stride - padding;
+                        int begin = std::max(0, -x0) * depth;
+                        int end = std::min(extend_filter, in_size.width - x0) * depth;
+                        const float *src = rows + (y * out_width + x) * patch_size;
+                        for(int j = 0; j < extend_filter; j++, src += run) {
+                                int in_y = y0 + j;
+                                if(in_y < 0 || in_y >= in_size.height)
+                                        continue;
+                                int dst = (in_y * in_size.width + x0) * depth;
+                                for(int k = begin; k < end; k++)
+                                        in[dst + k] += src[k];
+                        }
+                }
+        }
+}
+
+}
+
+#endif
@@ -3,11 +3,13 @@
 
 #include "common.cpp"
 #include "tensor_float.cpp"
+#include "tensor_view.cpp"
+#include "optimizer.cpp"
 #include "layer_grid_frame_buffer.cpp"
 
 namespace NeuralNetwork {
 
-enum LayerType { convolutional, fc, relu, pool, dropout_layer };
+enum LayerType { convolutional, fc, relu, pool, dropout_layer, conv_relu_pool, softmax_cross_entropy, layout_conversion };
 
 // Layer abstract class
 class Layer {
@@ -15,18 +17,56 @@ class Layer {
 public:
 
 LayerType type;
-TensorFloat *input_gradients;
-TensorFloat *input;
-TensorFloat *output;
+TensorFloat *input_gradients = NULL;
+TensorView input; // the previous layer output or the network input, owned by the caller
+TensorFloat *output = NULL;
 size_tensor input_size;
 size_tensor output_size;
-LayerGridFrameBuffer *gridRenderFrameBuffer;
+LayerGridFrameBuffer *gridRenderFrameBuffer = NULL; // NULL on replicas, which never render
+Layer *master = NULL; // replicas share the weights of their master layer
+int batch_size = 1; // samples per activation, output and input_gradients hold one tensor per sample
+int accumulated_samples = 1; // samples summed into the weight gradients by calc_grads
+bool snapshot = false; // the render buffers are refreshed only while this is set
+bool deferred_update = false; // set while a trainer sums the weight gradients of replicas before fix_weights()
+Optimizer *optimizer = NULL; // updates the weights of layers that have some, shared by their replicas
+TensorLayout layout = layout_nchw; // of the input, the output and their gradients
 
-virtual void activate(TensorFloat*)=0;
+// Reallocates the per sample buffers in place, output and input_gradients keep their address.
+// Layers call it from activate() when the batch size of the input changes.
+virtual void set_batch_size(int)=0;
+virtual void activate(const TensorView&)=0;
 virtual void activate()=0;
-virtual void calc_grads(TensorFloat*)=0;
+virtual void calc_grads(const TensorView&)=0;
 virtual void fix_weights()=0;
 
+// Floats of per-step scratch memory the layer needs for its current batch size. The
+// Workspace reserves them once and hands them over with bind_workspace().
+virtual int workspace_size()
+{
+        return 0;
+}
+
+virtual void bind_workspace(float*) {}
+
+// Switches the layer to tensors of the given layout, before it is replicated. Returns
+// false, leaving the layer as it is, if the layer has no kernels for that layout.
+virtual bool set_layout(TensorLayout layout)
+{
+        return layout == layout_nchw;
+}
+
+// Creates a copy that shares the weights of this layer but owns its activations and
+// gradients, so several threads can run forward and backward passes at the same time.
+virtual Layer* replicate()=0;
+
+// Adds the weight gradients of a replica of this layer to its own gradients.
+virtual void accumulate_gradients(Layer *replica)
+{
+        accumulated_samples += replica->accumulated_samples;
+}
+
+virtual ~Layer() {}
+
 };
 
 }
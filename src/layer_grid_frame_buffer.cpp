@@ -3,6 +3,7 @@
 
 #include <cassert>
 #include <vector>
+#include <cstring>
 #include "tensor_render_frame_buffer.cpp"
 
 using namespace std;
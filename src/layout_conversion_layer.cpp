@@ -0,0 +1,145 @@
+#ifndef _LAYOUT_CONVERSION_LAYER_CPP
+#define _LAYOUT_CONVERSION_LAYER_CPP
+
+#include <cassert>
+#include <algorithm>
+#include <vector>
+#include "layer.cpp"
+#include "tensor_float.cpp"
+#include "tensor_view.cpp"
+
+namespace NeuralNetwork {
+
+#define LAYOUT_TRANSPOSE_BLOCK 16 // rows and columns of the blocks of the transposes, both sides stay in L1
+
+// out = in^T, in being a rows x cols matrix
+static void transpose(const float *__restrict in, int rows, int cols, float *__restrict out)
+{
+        for(int r0 = 0; r0 < rows; r0 += LAYOUT_TRANSPOSE_BLOCK) {
+                int r1 = std::min(rows, r0 + LAYOUT_TRANSPOSE_BLOCK);
+                for(int c0 = 0; c0 < cols; c0 += LAYOUT_TRANSPOSE_BLOCK) {
+                        int c1 = std::min(cols, c0 + LAYOUT_TRANSPOSE_BLOCK);
+                        for(int r = r0; r < r1; r++)
+                                for(int c = c0; c < c1; c++)
+                                        out[c * rows + r] = in[r * cols + c];
+                }
+        }
+}
+
+// Rewrites a sample of the given layout in the other one. A planar sample is a
+// depth x positions matrix and a channel-last one its transpose.
+static void convert_layout(const float *in, size_tensor size, TensorLayout from, float *out)
+{
+        int area = size.width * size.height;
+        if(from == layout_nchw)
+                transpose(in, size.depth, area, out);
+        else
+                transpose(in, area, size.depth, out);
+}
+
+// Converts its input to another layout and the gradients back. The layout pass puts these
+// layers at the edges of the channel-last runs of a network, they are never drawn.
+class LayoutConversionLayer : public Layer {
+
+public:
+
+TensorLayout input_layout; // of the input and its gradients, layout is that of the output
+
+LayoutConversionLayer(size_tensor in_size, TensorLayout from, TensorLayout to) {
+        type = LayerType::layout_conversion;
+        input_size = output_size = in_size;
+        input_layout = from;
+        layout = to;
+        input_gradients = new TensorFloat(in_size.width, in_size.height, in_size.depth, 1, from);
+        output = new TensorFloat(in_size.width, in_size.height, in_size.depth, 1, to);
+}
+
+LayoutConversionLayer(LayoutConversionLayer *master_layer) : LayoutConversionLayer(master_layer->input_size, master_layer->input_layout, master_layer->layout) {
+        master = master_layer;
+}
+
+Layer* replicate() {
+        return new LayoutConversionLayer(this);
+}
+
+void set_batch_size(int n) {
+        batch_size = n;
+
+        *input_gradients = TensorFloat(input_size.width, input_size.height, input_size.depth, n, input_layout);
+        *output = TensorFloat(input_size.width, input_size.height, input_size.depth, n, layout);
+}
+
+void activate(const TensorView &in) {
+        if(in.batch != batch_size) {
+                set_batch_size(in.batch);
+        }
+        this->input = in;
+        activate();
+}
+
+void activate() {
+
+        assert(input.contiguous() && input.layout == input_layout);
+        for(int n = 0; n < batch_size; n++)
+                convert_layout(input.sample(n), input_size, input_layout, output->sample(n));
+
+}
+
+void calc_grads(const TensorView &grad_next_layer) {
+
+        assert(grad_next_layer.contiguous() && grad_next_layer.layout == layout);
+        for(int n = 0; n < batch_size; n++)
+                convert_layout(grad_next_layer.sample(n), input_size, layout, input_gradients->sample(n));
+
+}
+
+void fix_weights() {
+
+}
+
+~LayoutConversionLayer() {
+        delete input_gradients;
+        delete output;
+}
+
+};
+
+// Layout pass: returns the layers to train, where every run of consecutive layers with
+// channel-last kernels that holds a convolution is switched to channel-last tensors, with
+// a LayoutConversionLayer on both sides. Edges of a single channel need no conversion. The
+// layers of the runs are changed in place, so the pass runs before any replication.
+static vector<Layer*> use_channels_last(const vector<Layer*> &layers)
+{
+        vector<Layer*> converted;
+        for(int i = 0; i < layers.size();) {
+                int end = i;
+                bool convolution = false;
+                while(end < layers.size() && layers[end]->set_layout(layout_nhwc)) {
+                        convolution |= layers[end]->type == LayerType::convolutional;
+                        end++;
+                }
+                if(!convolution) {
+                        // nothing gains from the conversions, the run stays planar
+                        for(int j = i; j < end; j++)
+                                layers[j]->set_layout(layout_nchw);
+                        for(int j = i; j < max(end, i + 1); j++)
+                                converted.push_back(layers[j]);
+                        i = max(end, i + 1);
+                        continue;
+                }
+
+                if(layers[i]->input_size.depth > 1)
+                        converted.push_back(new LayoutConversionLayer(layers[i]->input_size, layout_nchw, layout_nhwc));
+                for(int j = i; j < end; j++)
+                        converted.push_back(layers[j]);
+                size_tensor out_size = layers[end - 1]->output->size;
+                if(end < layers.size() && out_size.depth > 1)
+                        converted.push_back(new LayoutConversionLayer(out_size, layout_nhwc, layout_nchw));
+                i = end;
+        }
+        return converted;
+}
+
+}
+
+#endif
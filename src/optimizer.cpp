@@ -0,0 +1,131 @@
+#ifndef _OPTIMIZER_CPP
+#define _OPTIMIZER_CPP
+
+#include <cmath>
+#include "common.cpp"
+#include "tensor_gradient.cpp"
+
+namespace NeuralNetwork {
+
+// Turns the weight gradients into weight updates. Layers call it once per weights tensor,
+// or once per range of a tensor they update piecewise. The optimizer state of the weights
+// lives in their TensorGradient, so replicas owning their gradients own their state too.
+// Every kernel reads the weights, gradients and state once and writes them back once.
+// The hyperparameters are plain members and can be changed between steps.
+class Optimizer {
+
+public:
+
+float learning_rate;
+float weight_decay; // decoupled from the gradient: every step shrinks the weights by learning_rate * weight_decay
+
+// Starts the update of a weights tensor and returns its update number, from 1
+int begin_update(TensorGradient *gradients) {
+        if(uses_squares() && gradients->oldgrad_squares == NULL)
+                gradients->reserve_squares();
+        return ++gradients->updates;
+}
+
+// Updates count weights from their gradients scaled by grad_scale (1 / samples in the batch).
+// momentum and squares are the state of the same weights, squares is NULL unless uses_squares().
+virtual void update_range(float *__restrict w, const float *__restrict grad, float *__restrict momentum, float *__restrict squares, int count, float grad_scale, int step)=0;
+
+// Running mean of the squared gradients needed by the optimizer
+virtual bool uses_squares()
+{
+        return false;
+}
+
+// Updates a whole weights tensor allocated by aligned_float_alloc
+void update(float *weights, TensorGradient *gradients, float grad_scale) {
+        int step = begin_update(gradients);
+        float *squares = gradients->oldgrad_squares;
+        update_range(ASSUME_TENSOR_ALIGNED(weights), ASSUME_TENSOR_ALIGNED(gradients->grad), ASSUME_TENSOR_ALIGNED(gradients->oldgrad),
+                     squares == NULL ? NULL : ASSUME_TENSOR_ALIGNED(squares), gradients->count(), grad_scale, step);
+}
+
+virtual ~Optimizer() {}
+
+};
+
+// SGD with momentum, or with Nesterov momentum which applies the gradient once more
+// through the updated momentum
+class SgdOptimizer : public Optimizer {
+
+public:
+
+float momentum;
+bool nesterov;
+
+SgdOptimizer(float learning_rate, float momentum, float weight_decay, bool nesterov = false) {
+        this->learning_rate = learning_rate;
+        this->momentum = momentum;
+        this->weight_decay = weight_decay;
+        this->nesterov = nesterov;
+}
+
+void update_range(float *__restrict w, const float *__restrict grad, float *__restrict oldgrad, float *__restrict, int count, float grad_scale, int) {
+        float lr = learning_rate;
+        float mu = momentum;
+        float decay = learning_rate * weight_decay;
+        if(nesterov) {
+                for(int i = 0; i < count; i++) {
+                        float g = grad[i] * grad_scale;
+                        float m = g + oldgrad[i] * mu;
+                        w[i] -= lr * (g + mu * m) + decay * w[i];
+                        oldgrad[i] = m;
+                }
+        } else {
+                for(int i = 0; i < count; i++) {
+                        float m = grad[i] * grad_scale + oldgrad[i] * mu;
+                        w[i] -= lr * m + decay * w[i];
+                        oldgrad[i] = m;
+                }
+        }
+}
+
+};
+
+// Adam with decoupled weight decay (AdamW)
+class AdamOptimizer : public Optimizer {
+
+public:
+
+float beta1;
+float beta2;
+float epsilon;
+
+AdamOptimizer(float learning_rate, float weight_decay, float beta1 = 0.9f, float beta2 = 0.999f, float epsilon = 1e-8f) {
+        this->learning_rate = learning_rate;
+        this->weight_decay = weight_decay;
+        this->beta1 = beta1;
+        this->beta2 = beta2;
+        this->epsilon = epsilon;
+}
+
+bool uses_squares() {
+        return true;
+}
+
+void update_range(float *__restrict w, const float *__restrict grad, float *__restrict oldgrad, float *__restrict squares, int count, float grad_scale, int step) {
+        // bias corrections of the moments, which start at 0
+        float correction1 = 1.0f / (1.0f - powf(beta1, step));
+        float correction2 = 1.0f / (1.0f - powf(beta2, step));
+        float lr = learning_rate;
+        float decay = learning_rate * weight_decay;
+        float b1 = beta1, b2 = beta2, eps = epsilon;
+        for(int i = 0; i < count; i++) {
+                float g = grad[i] * grad_scale;
+                float m = b1 * oldgrad[i] + (1 - b1) * g;
+                float v = b2 * squares[i] + (1 - b2) * g * g;
+                w[i] -= lr * (m * correction1) / (sqrtf(v * correction2) + eps) + decay * w[i];
+                oldgrad[i] = m;
+                squares[i] = v;
+        }
+}
+
+};
+
+}
+
+#endif
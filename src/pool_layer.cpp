@@ -2,10 +2,13 @@
 #define _POOL_LAYER_CPP
 
 #include <cmath>
-#include <float.h>
 #include <cassert>
+#include <cstdint>
+#include <cstring>
+#include <algorithm>
 #include <vector>
 #include "layer.cpp"
+#include "activation.cpp"
 #include "tensor_float.cpp"
 #include "tensor_gradient.cpp"
 #include "layer_grid_frame_buffer.cpp"
@@ -13,17 +16,28 @@
 
 namespace NeuralNetwork {
 
+#define POOL_NO_GRADIENT 0xFF // argmax of a window that receives no gradient, e.g. clamped to 0 by a fused ReLU
+
+// Max pooling. The forward pass records the position of the maximum of every window, so
+// the backward pass is a single scatter of the output gradients. The padding around the
+// input is never the maximum, only the windows over the border check their bounds.
+// Channel-last tensors are pooled across the channels of every window at once.
 class PoolLayer : public Layer {
 
 public:
 
 vector<TensorGradient*> filter_gradients;
 int stride, extend_filter;
+int padding; // positions around every side of the input that windows may cover
+vector<uint8_t> argmax; // window offset j * extend_filter + i of the maximum of every output, one per output value of the batch
 
-PoolLayer(int stride, int extend_filter, size_tensor in_size) {
+PoolLayer(int stride, int extend_filter, size_tensor in_size, int padding = 0) {
         type = LayerType::pool;
         input_size = in_size;
+        int out_width = window_outputs(in_size.width, extend_filter, stride, padding);
+        int out_height = window_outputs(in_size.height, extend_filter, stride, padding);
 
+#ifndef TENSAR_HEADLESS
         //Define and alloc a grid layout for render buffers
 
         // {input, gradient, output}
@@ -54,102 +68,237 @@ PoolLayer(int stride, int extend_filter, size_tensor in_size) {
         // Initialize forth column of the grid with Output buffers
         gridRenderFrameBuffer->column_titles.push_back((char*)"out");
         subtitle = new char[50];
-        sprintf(subtitle, "%d x %d", (in_size.width - extend_filter) / stride + 1, (in_size.height - extend_filter) / stride + 1);
+        sprintf(subtitle, "%d x %d", out_width, out_height);
         gridRenderFrameBuffer->column_subtitles.push_back(subtitle);
 
         for(int i=0; i<in_size.depth; i++) {
-                gridRenderFrameBuffer->set(2, i, new TensorRenderFrameBuffer((in_size.width - extend_filter) / stride + 1, (in_size.height - extend_filter) / stride + 1));
+                gridRenderFrameBuffer->set(2, i, new TensorRenderFrameBuffer(out_width, out_height));
         }
+#endif
 
         input_gradients = new TensorFloat(in_size.width, in_size.height, in_size.depth);
-        input = new TensorFloat(in_size.width, in_size.height, in_size.depth);
-        output = new TensorFloat((in_size.width - extend_filter) / stride + 1, (in_size.height - extend_filter) / stride + 1, in_size.depth);
+        output = new TensorFloat(out_width, out_height, in_size.depth);
         this->stride = stride;
         this->extend_filter = extend_filter;
-        assert( (float( in_size.width - extend_filter ) / stride + 1) == ((in_size.width - extend_filter) / stride + 1) );
-        assert( (float( in_size.height - extend_filter ) / stride + 1) == ((in_size.height - extend_filter) / stride + 1) );
+        this->padding = padding;
+        assert(padding >= 0 && padding < extend_filter); // every window sees at least one input
+        assert(out_width > 0 && out_height > 0);
+        assert(extend_filter * extend_filter < POOL_NO_GRADIENT);
+        argmax = vector<uint8_t>(output->count());
 }
 
-point_tensor map_to_input(point_tensor out, int z) {
-        out.x *= stride;
-        out.y *= stride;
-        out.z = z;
-        return out;
+PoolLayer(PoolLayer *master_layer) {
+        type = LayerType::pool;
+        master = master_layer;
+        input_size = master_layer->input_size;
+        stride = master_layer->stride;
+        extend_filter = master_layer->extend_filter;
+        padding = master_layer->padding;
+        layout = master_layer->layout;
+        input_gradients = new TensorFloat(input_size.width, input_size.height, input_size.depth, 1, layout);
+        output = new TensorFloat(master_layer->output->size.width, master_layer->output->size.height, master_layer->output->size.depth, 1, layout);
+        argmax = vector<uint8_t>(output->count());
 }
 
-int normalize_range(float f, int max, bool lim_min) {
-        if(f <= 0) { return 0; }
-
-        max -= 1;
+Layer* replicate() {
+        return new PoolLayer(this);
+}
 
-        if(f >= max) { return max; }
+void set_batch_size(int n) {
+        batch_size = n;
 
-        if(lim_min) {
-                // left side of inequality
-                return ceil( f );
-        } else {
-                return floor( f );
-        }
+        *input_gradients = TensorFloat(input_size.width, input_size.height, input_size.depth, n, layout);
+        *output = TensorFloat(output->size.width, output->size.height, input_size.depth, n, layout);
+        argmax.resize(output->count());
 }
 
-range_tensor map_to_output(int x, int y) {
-        float a = x;
-        float b = y;
-        return {
-                       normalize_range( (a - extend_filter + 1) / stride, output->size.width, true ),
-                       normalize_range( (b - extend_filter + 1) / stride, output->size.height, true ),
-                       0,
-                       normalize_range( a / stride, output->size.width, false ),
-                       normalize_range( b / stride, output->size.height, false ),
-                       (int)output->size.depth - 1,
-        };
+bool set_layout(TensorLayout layout) {
+        this->layout = input_gradients->layout = output->layout = layout;
+        return true;
 }
 
-void activate(TensorFloat *in) {
+void activate(const TensorView &in) {
+        if(in.batch != batch_size) {
+                set_batch_size(in.batch);
+        }
         this->input = in;
+        if(snapshot)
+                render_input();
+
+        // Activate
+        activate();
+}
+
+void activate() {
 
-        for(int z = 0; z < in->size.depth; z++)
+        assert(input.contiguous() && (input.layout == layout || input.size.depth == 1));
+        if(layout == layout_nhwc && extend_filter == 2) {
+                activate_channels_last<2>();
+        } else if(layout == layout_nhwc) {
+                activate_channels_last<0>();
+        } else if(extend_filter == 2) {
+                activate_windows<2>();
+        } else if(extend_filter == 3) {
+                activate_windows<3>();
+        } else {
+                activate_windows<0>();
+        }
+
+        if(snapshot)
+                render_output();
+}
+
+// EXTEND > 0 fixes the window size at compile time, so the window loops unroll
+template<int EXTEND>
+void activate_windows() {
+
+        int extend = EXTEND > 0 ? EXTEND : extend_filter;
+        int in_width = input_size.width;
+        int in_area = input_size.width * input_size.height;
+        int out_width = output->size.width;
+        int out_height = output->size.height;
+
+        // outputs whose window lies inside the input, from the ranges of the first and last window element
+        int x_begin, x_end, y_begin, y_end, unused;
+        inside_outputs(-padding, input_size.width, stride, out_width, x_begin, unused);
+        inside_outputs(extend - 1 - padding, input_size.width, stride, out_width, unused, x_end);
+        inside_outputs(-padding, input_size.height, stride, out_height, y_begin, unused);
+        inside_outputs(extend - 1 - padding, input_size.height, stride, out_height, unused, y_end);
+        x_end = max(x_begin, x_end);
+        int step = stride, pad = padding; // locals, the uint8_t stores may alias the members
+
+        for(int n = 0; n < batch_size; n++)
         {
-                // Update render frame inputs buffer values
-                TensorRenderFrameBuffer* inputFrameBuffer = gridRenderFrameBuffer->get(0, z);
-                for(int x = 0; x < in->size.width; x++)
+                const float *sample = input.sample(n);
+                float *pooled = output->sample(n);
+                uint8_t *sample_argmax = &argmax[n * output->sample_size()];
+                for(int z = 0; z < output->size.depth; z++)
                 {
-                        for(int y = 0; y < in->size.height; y++)
+                        const float *plane = sample + z * in_area;
+                        for(int y = 0; y < out_height; y++)
                         {
-                                float value = in->get(x, y, z);
-                                inputFrameBuffer->set(x, y, (int)(value * 255));
+                                int out = (z * out_height + y) * out_width;
+                                if(y < y_begin || y >= y_end) {
+                                        pool_border_windows(plane, y, 0, out_width, pooled + out, sample_argmax + out);
+                                        continue;
+                                }
+
+                                if(x_begin > 0)
+                                        pool_border_windows(plane, y, 0, x_begin, pooled + out, sample_argmax + out);
+                                const float *window = plane + (y * step - pad) * in_width + x_begin * step - pad;
+                                for(int x = x_begin; x < x_end; x++, window += step)
+                                {
+                                        // branchless, the position of the maximum is unpredictable
+                                        float mval = window[0];
+                                        int offset = 0;
+                                        for(int j = 0; j < extend; j++)
+                                                for(int i = 0; i < extend; i++)
+                                                {
+                                                        float v = window[j * in_width + i];
+                                                        int greater = v > mval;
+                                                        offset += greater * (j * extend + i - offset);
+                                                        mval = max(v, mval);
+                                                }
+                                        pooled[out + x] = mval;
+                                        sample_argmax[out + x] = offset;
+                                }
+                                if(x_end < out_width)
+                                        pool_border_windows(plane, y, x_end, out_width, pooled + out, sample_argmax + out);
                         }
                 }
-                inputFrameBuffer->swapBuffers();
         }
 
-        // Activate
-        activate();
 }
 
-void activate() {
+// Outputs [x_begin, x_end) of row y, whose windows cover the padding: only the window
+// elements inside the input are compared
+void pool_border_windows(const float *plane, int y, int x_begin, int x_end, float *pooled, uint8_t *offsets) {
+        int y0 = y * stride - padding;
+        for(int x = x_begin; x < x_end; x++) {
+                int x0 = x * stride - padding;
+                float mval = -INFINITY;
+                int best = 0;
+                for(int j = max(0, -y0); j < min(extend_filter, input_size.height - y0); j++) {
+                        for(int i = max(0, -x0); i < min(extend_filter, input_size.width - x0); i++) {
+                                float v = plane[(y0 + j) * input_size.width + x0 + i];
+                                if(v > mval || mval == -INFINITY) {
+                                        mval = v;
+                                        best = j * extend_filter + i;
+                                }
+                        }
+                }
+                pooled[x] = mval;
+                offsets[x] = best;
+        }
+}
 
-        for(int z = 0; z < output->size.depth; z++)
+// Every window element is a run of depth channels, so the maxima and the argmax of a vector
+// of channels are updated side by side. The window is clipped to the input, no padding
+// element is ever compared.
+template<int EXTEND>
+void activate_channels_last() {
+
+        int extend = EXTEND > 0 ? EXTEND : extend_filter;
+        int depth = input_size.depth;
+        int in_width = input_size.width;
+        int in_height = input_size.height;
+        int out_width = output->size.width;
+        int out_height = output->size.height;
+        int step = stride, pad = padding; // locals, the uint8_t stores may alias the members
+
+        for(int n = 0; n < batch_size; n++)
         {
-                TensorRenderFrameBuffer* outputFrameBuffer = gridRenderFrameBuffer->get(2, z);
-                for(int x = 0; x < output->size.width; x++)
+                const float *sample = input.sample(n);
+                float *pooled = output->sample(n);
+                uint8_t *sample_argmax = &argmax[n * output->sample_size()];
+                for(int y = 0; y < out_height; y++)
                 {
-                        for(int y = 0; y < output->size.height; y++)
+                        int y0 = y * step - pad;
+                        int j_begin = max(0, -y0), j_end = min(extend, in_height - y0);
+                        for(int x = 0; x < out_width; x++)
                         {
-                                point_tensor mapped = map_to_input( { (uint16_t)x, (uint16_t)y, 0 }, 0 );
-                                float mval = -FLT_MAX;
-                                for(int i = 0; i < extend_filter; i++)
-                                        for(int j = 0; j < extend_filter; j++)
-                                        {
-                                                float v = (*input)(mapped.x + i, mapped.y + j, z);
-                                                if(v > mval)
-                                                        mval = v;
-                                        }
-                                (*output)(x, y, z) = mval;
-                                outputFrameBuffer->set(x, y, (int)(mval * 255));
+                                int x0 = x * step - pad;
+                                int i_begin = max(0, -x0), i_end = min(extend, in_width - x0);
+                                int out = (y * out_width + x) * depth;
+                                int first = ((y0 + j_begin) * in_width + x0 + i_begin) * depth; // first window element inside the input
+                                int first_element = j_begin * extend + i_begin;
+                                int c = 0;
+#if defined(__GNUC__)
+                                for(; c + ACTIVATION_VECTOR_WIDTH <= depth; c += ACTIVATION_VECTOR_WIDTH)
+                                {
+                                        activation_vector best = activation_load(sample + first + c);
+                                        activation_mask offset = {};
+                                        offset += first_element;
+                                        for(int j = j_begin; j < j_end; j++)
+                                                for(int i = i_begin; i < i_end; i++)
+                                                {
+                                                        activation_vector v = activation_load(sample + ((y0 + j) * in_width + x0 + i) * depth + c);
+                                                        activation_mask greater = v > best;
+                                                        offset = (greater & (j * extend + i)) | (~greater & offset);
+                                                        best = activation_select(greater, v, best);
+                                                }
+                                        activation_store(pooled + out + c, best);
+                                        for(int lane = 0; lane < ACTIVATION_VECTOR_WIDTH; lane++)
+                                                sample_argmax[out + c + lane] = offset[lane];
+                                }
+#endif
+                                for(; c < depth; c++)
+                                {
+                                        float best = sample[first + c];
+                                        int offset = first_element;
+                                        for(int j = j_begin; j < j_end; j++)
+                                                for(int i = i_begin; i < i_end; i++)
+                                                {
+                                                        float v = sample[((y0 + j) * in_width + x0 + i) * depth + c];
+                                                        int greater = v > best;
+                                                        offset += greater * (j * extend + i - offset);
+                                                        best = max(v, best);
+                                                }
+                                        pooled[out + c] = best;
+                                        sample_argmax[out + c] = offset;
+                                }
                         }
                 }
-                outputFrameBuffer->swapBuffers();
         }
 
 }
@@ -158,44 +307,98 @@ void fix_weights() {
 
 }
 
-void calc_grads(TensorFloat* grad_next_layer) {
+void calc_grads(const TensorView &grad_next_layer) {
+
+        scatter_gradients(grad_next_layer, input_gradients);
+
+        if(snapshot)
+                render_gradients();
+}
+
+// Routes the gradient of every output to the input that was the maximum of its window.
+// Overlapping windows add up; the other inputs get 0.
+void scatter_gradients(const TensorView &grad_next_layer, TensorFloat *gradients) {
 
-        for(int y = 0; y < input_size.height; y++)
+        int out_width = output->size.width;
+        int out_height = output->size.height;
+        TensorView pooled = output->view(), in = gradients->view(); // strides of either layout
+        memset(gradients->values, 0, gradients->count() * sizeof(float));
+
+        for(int n = 0; n < batch_size; n++)
         {
-                for(int x = 0; x < input_size.width; x++)
+                float *sample_gradients = gradients->sample(n);
+                const uint8_t *sample_argmax = &argmax[n * output->sample_size()];
+                for(int z = 0; z < output->size.depth; z++)
                 {
-                        range_tensor rn = map_to_output(x, y);
-                        for(int z = 0; z < input_size.depth; z++)
+                        for(int y = 0; y < out_height; y++)
                         {
-                                TensorRenderFrameBuffer* gradientFrameBuffer = gridRenderFrameBuffer->get(1, z);
-                                float sum_error = 0;
-                                for(int i = rn.min_x; i <= rn.max_x; i++)
+                                for(int x = 0; x < out_width; x++)
                                 {
-                                        int minx = i * stride;
-                                        for(int j = rn.min_y; j <= rn.max_y; j++)
-                                        {
-                                                int miny = j * stride;
-                                                int is_max = (*input)(x, y, z) == (*output)(i, j, z) ? 1 : 0;
-                                                sum_error += is_max * (*grad_next_layer)(i, j, z);
-                                        }
+                                        int offset = sample_argmax[z * pooled.plane_stride + y * pooled.row_stride + x * pooled.column_stride];
+                                        if(offset == POOL_NO_GRADIENT)
+                                                continue;
+                                        int in_x = x * stride - padding + offset % extend_filter;
+                                        int in_y = y * stride - padding + offset / extend_filter;
+                                        sample_gradients[z * in.plane_stride + in_y * in.row_stride + in_x * in.column_stride] += grad_next_layer.get(x, y, z, n);
                                 }
-                                (*input_gradients)(x, y, z) = sum_error;
-                                gradientFrameBuffer->set(x, y, (int)sum_error);
                         }
                 }
         }
 
-        for(int i=0; i<input_size.depth; i++) {
-                TensorRenderFrameBuffer* gradientFrameBuffer = gridRenderFrameBuffer->get(1, i);
-                gradientFrameBuffer->swapBuffers();
+}
+
+// Update render frame inputs buffer values
+void render_input() {
+
+#ifndef TENSAR_HEADLESS
+        if(gridRenderFrameBuffer == NULL)
+                return;
+
+        for(int z = 0; z < input.size.depth; z++)
+        {
+                TensorRenderFrameBuffer* inputFrameBuffer = gridRenderFrameBuffer->get(0, z);
+                inputFrameBuffer->set_values(input.values + z * input.plane_stride, 255, input.column_stride);
+                inputFrameBuffer->swapBuffers();
         }
+#endif
+}
+
+// Update render frame outputs buffer values
+void render_output() {
+
+#ifndef TENSAR_HEADLESS
+        if(gridRenderFrameBuffer == NULL)
+                return;
 
+        TensorView out = output->view();
+        for(int z = 0; z < out.size.depth; z++)
+        {
+                TensorRenderFrameBuffer* outputFrameBuffer = gridRenderFrameBuffer->get(2, z);
+                outputFrameBuffer->set_values(out.values + z * out.plane_stride, 255, out.column_stride);
+                outputFrameBuffer->swapBuffers();
+        }
+#endif
+}
+
+// Update render frame gradients buffer values
+void render_gradients() {
+
+#ifndef TENSAR_HEADLESS
+        if(gridRenderFrameBuffer == NULL)
+                return;
+
+        TensorView gradients = input_gradients->view();
+        for(int z = 0; z < input_size.depth; z++) {
+                TensorRenderFrameBuffer* gradientFrameBuffer = gridRenderFrameBuffer->get(1, z);
+                gradientFrameBuffer->set_values(gradients.values + z * gradients.plane_stride, 1, gradients.column_stride);
+                gradientFrameBuffer->swapBuffers();
+        }
+#endif
 }
 
 ~PoolLayer() {
         delete gridRenderFrameBuffer;
         delete input_gradients;
-        delete input;
         delete output;
         //TODO: Implement proper delete allocated filters
 
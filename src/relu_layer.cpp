@@ -3,6 +3,7 @@
 
 #include "layer.cpp"
 #include "tensor_float.cpp"
+#include "activation.cpp"
 #include "layer_grid_frame_buffer.cpp"
 #include "tensor_render_frame_buffer.cpp"
 
@@ -16,6 +17,7 @@ ReLuLayer(size_tensor in_size) {
         type = LayerType::relu;
         input_size = in_size;
 
+#ifndef TENSAR_HEADLESS
         //Define and alloc a grid layout for render buffers
 
         // {input, output}
@@ -42,29 +44,45 @@ ReLuLayer(size_tensor in_size) {
         for(int i=0; i<in_size.depth; i++) {
                 gridRenderFrameBuffer->set(1, i, new TensorRenderFrameBuffer(in_size.width, in_size.height));
         }
+#endif
 
         input_gradients = new TensorFloat(in_size.width, in_size.height, in_size.depth);
-        input = new TensorFloat(in_size.width, in_size.height, in_size.depth);
         output = new TensorFloat(in_size.width, in_size.height, in_size.depth);
 }
 
-void activate(TensorFloat *in) {
-        this->input = in;
+ReLuLayer(ReLuLayer *master_layer) {
+        type = LayerType::relu;
+        master = master_layer;
+        input_size = master_layer->input_size;
+        layout = master_layer->layout;
+        input_gradients = new TensorFloat(input_size.width, input_size.height, input_size.depth, 1, layout);
+        output = new TensorFloat(input_size.width, input_size.height, input_size.depth, 1, layout);
+}
 
-        for(int z = 0; z < in->size.depth; z++)
-        {
-                // Update render frame input buffer values
-                TensorRenderFrameBuffer* inputFrameBuffer = gridRenderFrameBuffer->get(0, z);
-                for(int x = 0; x < in->size.width; x++)
-                {
-                        for(int y = 0; y < in->size.height; y++)
-                        {
-                                float value = in->get(x, y, z);
-                                inputFrameBuffer->set(x, y, (int)(value * 255));
-                        }
-                }
-                inputFrameBuffer->swapBuffers();
+Layer* replicate() {
+        return new ReLuLayer(this);
+}
+
+void set_batch_size(int n) {
+        batch_size = n;
+
+        *input_gradients = TensorFloat(input_size.width, input_size.height, input_size.depth, n, layout);
+        *output = TensorFloat(input_size.width, input_size.height, input_size.depth, n, layout);
+}
+
+// The kernels run over flat arrays, the same in any layout
+bool set_layout(TensorLayout layout) {
+        this->layout = input_gradients->layout = output->layout = layout;
+        return true;
+}
+
+void activate(const TensorView &in) {
+        if(in.batch != batch_size) {
+                set_batch_size(in.batch);
         }
+        this->input = in;
+        if(snapshot)
+                render_input();
 
         // Activate
         activate();
@@ -72,48 +90,60 @@ void activate(TensorFloat *in) {
 
 void activate() {
 
-        for(int z = 0; z < input->size.depth; z++)
+        assert(input.contiguous() && (input.layout == layout || input.size.depth == 1));
+        relu_forward(input.values, output->values, input.count());
+
+        if(snapshot)
+                render_output();
+}
+
+// Update render frame input buffer values
+void render_input() {
+
+#ifndef TENSAR_HEADLESS
+        if(gridRenderFrameBuffer == NULL)
+                return;
+
+        for(int z = 0; z < input.size.depth; z++)
+        {
+                TensorRenderFrameBuffer* inputFrameBuffer = gridRenderFrameBuffer->get(0, z);
+                inputFrameBuffer->set_values(input.values + z * input.plane_stride, 255, input.column_stride);
+                inputFrameBuffer->swapBuffers();
+        }
+#endif
+}
+
+// Update render frame output buffer values
+void render_output() {
+
+#ifndef TENSAR_HEADLESS
+        if(gridRenderFrameBuffer == NULL)
+                return;
+
+        TensorView out = output->view();
+        for(int z = 0; z < out.size.depth; z++)
         {
                 TensorRenderFrameBuffer* outputFrameBuffer = gridRenderFrameBuffer->get(1, z);
-                for(int x = 0; x < input->size.width; x++)
-                {
-                        for(int y = 0; y < input->size.height; y++)
-                        {
-
-                                float value = (*input)(x, y, z);   //in(x, y, z);
-                                if(value < 0)
-                                        value = 0;
-                                (*output)(x, y, z) = value;
-                                outputFrameBuffer->set(x, y, (int)(value * 255));
-                        }
-                }
+                outputFrameBuffer->set_values(out.values + z * out.plane_stride, 255, out.column_stride);
                 outputFrameBuffer->swapBuffers();
         }
+#endif
 }
 
 void fix_weights() {
 
 }
 
-void calc_grads(TensorFloat* grad_next_layer) {
+void calc_grads(const TensorView &grad_next_layer) {
 
-        for(int x = 0; x < input->size.width; x++)
-        {
-                for(int y = 0; y < input->size.height; y++)
-                {
-                        for(int z = 0; z < input->size.depth; z++)
-                        {
-                                (*input_gradients)(x, y, z) = ((*input)(x, y, z) < 0) ? 0 : (1 * (*grad_next_layer)(x, y, z));
-                        }
-                }
-        }
+        assert(input.contiguous() && grad_next_layer.contiguous());
+        relu_backward(input.values, grad_next_layer.values, input_gradients->values, input.count());
 
 }
 
 ~ReLuLayer() {
         delete gridRenderFrameBuffer;
         delete input_gradients;
-        delete input;
         delete output;
 }
 
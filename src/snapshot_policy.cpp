@@ -0,0 +1,60 @@
+#ifndef _SNAPSHOT_POLICY_CPP
+#define _SNAPSHOT_POLICY_CPP
+
+#include <atomic>
+#include <chrono>
+
+using namespace std;
+
+namespace NeuralNetwork {
+
+// Decides which training steps refresh the render buffers of the layers. A step takes a
+// snapshot when the render thread has requested one, or optionally every N steps or every
+// X milliseconds. The other steps never touch the render buffers.
+class SnapshotPolicy {
+
+public:
+
+atomic<bool> requested;
+int every_steps; // 0 disables the steps policy
+int every_ms; // 0 disables the time policy
+int steps = 0;
+chrono::steady_clock::time_point last_snapshot;
+
+SnapshotPolicy(int every_steps = 0, int every_ms = 0) {
+        this->every_steps = every_steps;
+        this->every_ms = every_ms;
+        requested = true; // the first step always takes a snapshot
+        last_snapshot = chrono::steady_clock::now();
+}
+
+// Called by the render thread when it wants fresh tensors
+void request() {
+        requested.store(true, memory_order_relaxed);
+}
+
+// Called by the training thread once per step, returns true if the step takes a snapshot
+bool due() {
+        bool snapshot = requested.exchange(false, memory_order_relaxed);
+
+        if(every_steps > 0 && ++steps >= every_steps)
+                snapshot = true;
+
+        if(every_ms > 0) {
+                chrono::steady_clock::time_point now = chrono::steady_clock::now();
+                if(chrono::duration_cast<chrono::milliseconds>(now - last_snapshot).count() >= every_ms)
+                        snapshot = true;
+        }
+
+        if(snapshot) {
+                steps = 0;
+                last_snapshot = chrono::steady_clock::now();
+        }
+        return snapshot;
+}
+
+};
+
+}
+
+#endif
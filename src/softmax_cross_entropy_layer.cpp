@@ -0,0 +1,169 @@
+#ifndef _SOFTMAX_CROSS_ENTROPY_LAYER_CPP
+#define _SOFTMAX_CROSS_ENTROPY_LAYER_CPP
+
+#include <vector>
+#include <cmath>
+#include <cfloat>
+#include <cassert>
+#include "layer.cpp"
+#include "tensor_float.cpp"
+#include "tensor_view.cpp"
+#include "activation.cpp"
+#include "layer_grid_frame_buffer.cpp"
+#include "tensor_render_frame_buffer.cpp"
+
+namespace NeuralNetwork {
+
+// Output head of a classifier, fed with the logits of the previous layer. Forward computes
+// the class probabilities and the predicted class of every sample. Backward takes the
+// one-hot expected output in place of the next layer gradients and computes, in a single
+// pass over every sample, the cross entropy loss, the gradient p - y of softmax followed
+// by cross entropy and whether the prediction was right.
+class SoftmaxCrossEntropyLayer : public Layer {
+
+public:
+
+vector<int> predicted; // most probable class of every sample
+float loss = 0; // summed cross entropy of the samples of the last calc_grads
+int errors = 0; // misclassified samples of the last calc_grads
+
+SoftmaxCrossEntropyLayer(size_tensor in_size) {
+        type = LayerType::softmax_cross_entropy;
+        input_size = in_size;
+        output_size = in_size;
+
+#ifndef TENSAR_HEADLESS
+        //Define and alloc a grid layout for render buffers
+
+        // {input, output}
+        // {cellObj, cellObj}
+
+        gridRenderFrameBuffer = new LayerGridFrameBuffer(2, 1, (char*)"Softmax");   // 2 = {input, output}
+
+        // Initialize first column of the grid with Inputs buffers
+        gridRenderFrameBuffer->column_titles.push_back((char*)"logits");
+        char *subtitle = new char[50];
+        sprintf(subtitle, "%d x %d", in_size.width, in_size.height);
+        gridRenderFrameBuffer->column_subtitles.push_back(subtitle);
+        gridRenderFrameBuffer->set(0, 0, new TensorRenderFrameBuffer(in_size.width, in_size.height));
+
+        // Initialize second column of the grid with Output buffers
+        gridRenderFrameBuffer->column_titles.push_back((char*)"prob");
+        subtitle = new char[50];
+        sprintf(subtitle, "%d x %d", in_size.width, in_size.height);
+        gridRenderFrameBuffer->column_subtitles.push_back(subtitle);
+        gridRenderFrameBuffer->set(1, 0, new TensorRenderFrameBuffer(in_size.width, in_size.height));
+#endif
+
+        input_gradients = new TensorFloat(in_size.width, in_size.height, in_size.depth);
+        output = new TensorFloat(in_size.width, in_size.height, in_size.depth);
+        predicted = vector<int>(1);
+}
+
+SoftmaxCrossEntropyLayer(SoftmaxCrossEntropyLayer *master_layer) {
+        type = LayerType::softmax_cross_entropy;
+        master = master_layer;
+        input_size = master_layer->input_size;
+        output_size = master_layer->output_size;
+        input_gradients = new TensorFloat(input_size.width, input_size.height, input_size.depth);
+        output = new TensorFloat(output_size.width, output_size.height, output_size.depth);
+        predicted = vector<int>(1);
+}
+
+Layer* replicate() {
+        return new SoftmaxCrossEntropyLayer(this);
+}
+
+void set_batch_size(int n) {
+        batch_size = n;
+
+        *input_gradients = TensorFloat(input_size.width, input_size.height, input_size.depth, n);
+        *output = TensorFloat(output_size.width, output_size.height, output_size.depth, n);
+        predicted = vector<int>(n);
+}
+
+void activate(const TensorView &in) {
+        if(in.batch != batch_size) {
+                set_batch_size(in.batch);
+        }
+        this->input = in;
+        if(snapshot)
+                render_input();
+
+        // Activate
+        activate();
+}
+
+void activate() {
+
+        assert(input.contiguous());
+        softmax_forward(input.values, output->values, output->sample_size(), batch_size, predicted.data());
+
+        if(snapshot)
+                render_output();
+}
+
+// Update render frame inputs buffer values
+void render_input() {
+
+#ifndef TENSAR_HEADLESS
+        if(gridRenderFrameBuffer == NULL)
+                return;
+
+        TensorRenderFrameBuffer* inputFrameBuffer = gridRenderFrameBuffer->get(0, 0);
+        inputFrameBuffer->set_values(input.values, 255);
+        inputFrameBuffer->swapBuffers();
+#endif
+}
+
+// Update render frame outputs buffer values
+void render_output() {
+
+#ifndef TENSAR_HEADLESS
+        if(gridRenderFrameBuffer == NULL)
+                return;
+
+        TensorRenderFrameBuffer* outputFrameBuffer = gridRenderFrameBuffer->get(1, 0);
+        outputFrameBuffer->set_values(output->values, 255);
+        outputFrameBuffer->swapBuffers();
+#endif
+}
+
+void fix_weights() {
+
+}
+
+// expected holds the one-hot expected output of every sample
+void calc_grads(const TensorView &expected) {
+
+        assert(expected.contiguous() && expected.count() == output->count());
+        int classes = output->sample_size();
+        loss = 0;
+        errors = 0;
+
+        for(int b = 0; b < batch_size; b++) {
+                const float *p = output->sample(b);
+                const float *y = expected.sample(b);
+                float *grad = input_gradients->sample(b);
+                int label = 0;
+                for(int c = 0; c < classes; c++) {
+                        grad[c] = p[c] - y[c];
+                        label = y[c] > y[label] ? c : label;
+                }
+                loss -= log(fmax(p[label], FLT_MIN));
+                errors += predicted[b] != label;
+        }
+
+}
+
+~SoftmaxCrossEntropyLayer() {
+        delete gridRenderFrameBuffer;
+        delete input_gradients;
+        delete output;
+}
+
+};
+
+}
+
+#endif
@@ -0,0 +1,94 @@
+#ifndef _SURFACE_MESH_CPP
+#define _SURFACE_MESH_CPP
+
+#include <vector>
+#include <algorithm>
+#include "tensor_render_frame_buffer.cpp"
+
+using namespace std;
+
+namespace NeuralNetwork {
+
+// Packed vertex, color and index arrays of the 3D surface chart of a frame buffer, ready to
+// be drawn as GL_TRIANGLES with vertex arrays. Every tensor cell is one vertex whose height is
+// its signed value; the arrays are rebuilt only when a new frame has been consumed.
+class SurfaceMesh {
+
+public:
+
+vector<float> vertices; // x, y, z of every vertex
+vector<unsigned char> colors; // RGBA of every vertex
+vector<unsigned int> indices; // 2 triangles per quad
+const TensorRenderFrameBuffer *source = NULL;
+unsigned int source_generation = 0;
+int columns = 0; // vertices per row
+int rows = 0;
+
+// Rebuilds the mesh from the consumer frame of the frame buffer, unless it already holds it.
+// The chart spans chart_width along x and chart_depth along -z; a value of 255 is height_scale high.
+void update(const TensorRenderFrameBuffer *frameBuffer, float chart_width, float chart_depth, float height_scale)
+{
+        if(frameBuffer == source && frameBuffer->consumer_generation == source_generation && !vertices.empty())
+                return;
+
+        source = frameBuffer;
+        source_generation = frameBuffer->consumer_generation;
+
+        // tensors one cell wide or high are drawn as a strip two vertices wide
+        int width = frameBuffer->width;
+        int height = frameBuffer->height;
+        int new_columns = max(width, 2);
+        int new_rows = max(height, 2);
+        if(new_columns != columns || new_rows != rows) {
+                columns = new_columns;
+                rows = new_rows;
+                vertices.resize(columns * rows * 3);
+                colors.resize(columns * rows * 4);
+                build_indices();
+        }
+
+        float cell_width = chart_width / width;
+        float cell_depth = chart_depth / height;
+        const unsigned char *pixels = frameBuffer->consumer_frame_buffer;
+        int pitch = frameBuffer->texture_width * 4;
+
+        for(int j = 0; j < rows; j++) {
+                const unsigned char *row = pixels + min(j, height - 1) * pitch;
+                for(int i = 0; i < columns; i++) {
+                        const unsigned char *pixel = row + min(i, width - 1) * 4;
+                        int v = (j * columns + i);
+                        vertices[v * 3] = i * cell_width;
+                        vertices[v * 3 + 1] = ((pixel[1] - pixel[0]) * height_scale) / 255;
+                        vertices[v * 3 + 2] = -j * cell_depth;
+                        colors[v * 4] = pixel[0];
+                        colors[v * 4 + 1] = pixel[1];
+                        colors[v * 4 + 2] = pixel[2];
+                        colors[v * 4 + 3] = 255;
+                }
+        }
+}
+
+private:
+
+void build_indices()
+{
+        indices.clear();
+        for(int j = 0; j < rows - 1; j++) {
+                for(int i = 0; i < columns - 1; i++) {
+                        unsigned int top_left = j * columns + i;
+                        unsigned int bottom_left = (j + 1) * columns + i;
+                        indices.push_back(top_left);
+                        indices.push_back(bottom_left);
+                        indices.push_back(bottom_left + 1);
+                        indices.push_back(top_left);
+                        indices.push_back(bottom_left + 1);
+                        indices.push_back(top_left + 1);
+                }
+        }
+}
+
+};
+
+}
+
+#endif
@@ -10,6 +10,7 @@ class Tensor {
 public:
 
 size_tensor size;
+TensorLayout layout = layout_nchw;
 
 };
 
@@ -3,41 +3,86 @@
 
 #include <cassert>
 #include <iostream>
+#include <cstring>
 #include "tensor.cpp"
+#include "tensor_view.cpp"
 
 namespace NeuralNetwork {
 
+// Dense batch of tensors owning its values, allocated on TENSOR_ALIGNMENT boundaries.
+// Copies are deep, moves hand the values over.
 class TensorFloat : public Tensor {
 
 public:
 
 float *values = NULL;
+int batch = 1; // number of samples, stored one after another
 
 TensorFloat() {
 
 }
 
-TensorFloat(int width, int height, int depth) {
-        values = new float[width * height * depth];
+TensorFloat(int width, int height, int depth, int batch = 1, TensorLayout layout = layout_nchw) {
+        values = aligned_float_alloc(width * height * depth * batch);
         size.width = width;
         size.height = height;
         size.depth = depth;
+        this->batch = batch;
+        this->layout = layout;
 }
 
 TensorFloat(const TensorFloat& t) {
-        values = new float[t.size.width * t.size.height * t.size.depth];
-        memcpy(this->values, t.values, t.size.width * t.size.height * t.size.depth * sizeof(float));
+        values = aligned_float_alloc(t.count());
+        memcpy(this->values, t.values, t.count() * sizeof(float));
         this->size = t.size;
+        this->batch = t.batch;
+        this->layout = t.layout;
 }
 
-static TensorFloat* diff(TensorFloat *tensor_a, TensorFloat *tensor_b) {
+TensorFloat(TensorFloat&& t) {
+        values = t.values;
+        size = t.size;
+        batch = t.batch;
+        layout = t.layout;
+        t.values = NULL;
+}
 
-        TensorFloat* clone = new TensorFloat(*tensor_a);
-        for(int i = 0; i < tensor_b->size.width * tensor_b->size.height * tensor_b->size.depth; i++) {
-                clone->values[i] -= tensor_b->values[i];
+TensorFloat& operator=(TensorFloat&& t) {
+        if(this != &t) {
+                if(values != NULL)
+                        aligned_float_free(values);
+                values = t.values;
+                size = t.size;
+                batch = t.batch;
+                layout = t.layout;
+                t.values = NULL;
         }
-        return clone;
+        return *this;
+}
+
+TensorFloat& operator=(const TensorFloat&) = delete;
+
+TensorView view() const
+{
+        return TensorView(values, size, batch, layout);
+}
 
+// Number of values of a single sample
+int sample_size() const
+{
+        return size.width * size.height * size.depth;
+}
+
+// Number of values of all the samples
+int count() const
+{
+        return sample_size() * batch;
+}
+
+float* sample(int n) const
+{
+        assert(n >= 0 && n < batch);
+        return values + n * sample_size();
 }
 
 float& operator()(int x, int y, int z) const
@@ -45,16 +90,31 @@ float& operator()(int x, int y, int z) const
         return this->get( x, y, z );
 }
 
+// Offset of (x, y, z) within a sample
+int index(int x, int y, int z) const
+{
+        if(layout == layout_nhwc)
+                return (y * size.width + x) * size.depth + z;
+        return z * (size.width * size.height) + y * size.width + x;
+}
+
 float& get(int x, int y, int z) const
 {
         assert(x >= 0 && y >= 0 && z >= 0);
         assert(x < size.width && y < size.height && z < size.depth);
-        return values[z * (size.width * size.height) + y * size.width + x];
+        return values[index(x, y, z)];
+}
+
+float& get(int x, int y, int z, int n) const
+{
+        assert(x >= 0 && y >= 0 && z >= 0 && n >= 0);
+        assert(x < size.width && y < size.height && z < size.depth && n < batch);
+        return values[n * sample_size() + index(x, y, z)];
 }
 
 ~TensorFloat() {
         if(values != NULL) {
-                delete[] values;
+                aligned_float_free(values);
         }
 }
 
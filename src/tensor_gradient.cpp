@@ -2,57 +2,74 @@
 #define _TENSOR_GRADIENT_CPP
 
 #include <cassert>
+#include <cstring>
 #include "tensor.cpp"
-#include "gradient.cpp"
 
 namespace NeuralNetwork {
 
+// Gradients of a weights tensor stored as two contiguous, aligned arrays with the
+// same layout as TensorFloat: the current gradient and the momentum of the previous steps.
+// Optimizers that also track the squared gradients reserve a third array on their first update.
 class TensorGradient : public Tensor {
 
 public:
 
-Gradient **values;
+float *grad = NULL;
+float *oldgrad = NULL;
+float *oldgrad_squares = NULL;
+int updates = 0; // optimizer steps applied to the weights
 
 TensorGradient(int width, int height, int depth) {
-        values = new Gradient*[width * height * depth];
-        for(int i=0; i < width * height * depth; i++) {
-                values[i] = new Gradient();
-                values[i]->grad = 0;
-                values[i]->oldgrad = 0;
-        }
         size.width = width;
         size.height = height;
         size.depth = depth;
+        grad = aligned_float_alloc(count());
+        oldgrad = aligned_float_alloc(count());
+        memset(grad, 0, count() * sizeof(float));
+        memset(oldgrad, 0, count() * sizeof(float));
 }
 
 TensorGradient(const TensorGradient* t) {
-        values = new Gradient*[t->size.width * t->size.height * t->size.depth];
-        for(int i=0; i < t->size.width * t->size.height * t->size.depth; i++) {
-                values[i] = new Gradient();
-                values[i]->grad = t->values[i]->grad;
-                values[i]->oldgrad = t->values[i]->oldgrad;
-        }
         this->size = t->size;
+        grad = aligned_float_alloc(count());
+        oldgrad = aligned_float_alloc(count());
+        memcpy(grad, t->grad, count() * sizeof(float));
+        memcpy(oldgrad, t->oldgrad, count() * sizeof(float));
+        if(t->oldgrad_squares != NULL) {
+                reserve_squares();
+                memcpy(oldgrad_squares, t->oldgrad_squares, count() * sizeof(float));
+        }
+        updates = t->updates;
+}
+
+void reserve_squares()
+{
+        oldgrad_squares = aligned_float_alloc(count());
+        memset(oldgrad_squares, 0, count() * sizeof(float));
 }
 
-Gradient* operator()(int x, int y, int z)
+int count() const
 {
-        return this->get(x, y, z);
+        return size.width * size.height * size.depth;
 }
 
-Gradient* get(int x, int y, int z)
+int index(int x, int y, int z) const
 {
         assert(x >= 0 && y >= 0 && z >= 0);
         assert(x < size.width && y < size.height && z < size.depth);
-        return values[z * (size.width * size.height) + y * size.width + x];
+        return z * (size.width * size.height) + y * size.width + x;
 }
 
-~TensorGradient() {
+void clear()
+{
+        memset(grad, 0, count() * sizeof(float));
+}
 
-        for(int i=0; i < this->size.width * this->size.height * this->size.depth; i++) {
-                delete values[i];
-        }
-        delete[] values;
+~TensorGradient() {
+        aligned_float_free(grad);
+        aligned_float_free(oldgrad);
+        if(oldgrad_squares != NULL)
+                aligned_float_free(oldgrad_squares);
 }
 };
 
@@ -2,18 +2,20 @@
 #define _TENSOR_RENDER_FRAME_BUFFER_CPP
 
 #include <cassert>
-#include <mutex>
-
-#ifdef __APPLE__
-#include <GLUT/glut.h>
-#else
-#include <GL/glut.h>
-#endif
+#include <atomic>
+#include <cstdlib>
 
 using namespace std;
 
 namespace NeuralNetwork {
 
+#define FRAME_BUFFER_INDEX_MASK 0x3
+#define FRAME_BUFFER_FRESH 0x4 // set in spare_index when the spare buffer holds an unconsumed frame
+
+// Wait-free triple buffer between the training thread (producer) and the render thread
+// (consumer). The producer draws into its own buffer and publishes it by exchanging it with
+// the spare one; the consumer takes the spare one only when it holds a newer frame. Neither
+// side ever waits for the other, and the consumer always sees the latest complete frame.
 class TensorRenderFrameBuffer {
 
 public:
@@ -23,35 +25,44 @@ int height; // pixels
 int texture_width; // pixels
 int texture_height; // pixels
 char *caption = NULL;
-GLuint texture = 0;
+unsigned int texture = 0; // GL texture name, created by the render thread
+unsigned int texture_generation = 0; // consumer_generation of the frame uploaded to the texture
 
-unsigned char *producer_frame_buffer = NULL;
-unsigned char *consumer_frame_buffer = NULL;
-mutex consumer_mutex;
-bool is_consuming_frame_buffer = false;
+unsigned char *frame_buffers[3] = {NULL, NULL, NULL};
+unsigned char *producer_frame_buffer = NULL; // only touched by the producer
+unsigned char *consumer_frame_buffer = NULL; // only touched by the consumer
+int producer_index = 0;
+int consumer_index = 1;
+atomic<int> spare_index;
+unsigned int consumer_generation = 0; // number of frames taken by the consumer
 
 TensorRenderFrameBuffer(int _width, int _height) {
-        texture_width = 64;
-        texture_height = 64;
         width = _width;
         height = _height;
 
-        producer_frame_buffer = (unsigned char *)malloc((texture_width * texture_height * 4));
-        consumer_frame_buffer = (unsigned char *)malloc((texture_width * texture_height * 4));
-
-        for(int x=0; x<texture_width; x++) {
-                for(int y=0; y<texture_height; y++) {
-                        producer_frame_buffer[(y * texture_width * 4) + x * 4] = 255;
-                        producer_frame_buffer[(y * texture_width * 4) + x * 4 + 1] = 255; // green
-                        producer_frame_buffer[(y * texture_width * 4) + x * 4 + 2] = 255;
-                        producer_frame_buffer[(y * texture_width * 4) + x * 4 + 3] = 0; //Alpha
-
-                        consumer_frame_buffer[(y * texture_width * 4) + x * 4] = 255;
-                        consumer_frame_buffer[(y * texture_width * 4) + x * 4 + 1] = 255; // green
-                        consumer_frame_buffer[(y * texture_width * 4) + x * 4 + 2] = 255;
-                        consumer_frame_buffer[(y * texture_width * 4) + x * 4 + 3] = 0; //Alpha
+        // power of two textures of at least 64 x 64 pixels, large enough for the tensor
+        texture_width = 64;
+        texture_height = 64;
+        while(texture_width < width)
+                texture_width *= 2;
+        while(texture_height < height)
+                texture_height *= 2;
+
+        for(int i = 0; i < 3; i++) {
+                frame_buffers[i] = (unsigned char *)malloc((texture_width * texture_height * 4));
+                for(int x=0; x<texture_width; x++) {
+                        for(int y=0; y<texture_height; y++) {
+                                frame_buffers[i][(y * texture_width * 4) + x * 4] = 255;
+                                frame_buffers[i][(y * texture_width * 4) + x * 4 + 1] = 255; // green
+                                frame_buffers[i][(y * texture_width * 4) + x * 4 + 2] = 255;
+                                frame_buffers[i][(y * texture_width * 4) + x * 4 + 3] = 0; //Alpha
+                        }
                 }
         }
+
+        producer_frame_buffer = frame_buffers[producer_index];
+        consumer_frame_buffer = frame_buffers[consumer_index];
+        spare_index = 2;
 }
 
 void set(int x, int y, signed int value) const
@@ -74,6 +85,25 @@ void set128(int x, int y, int value) const
         producer_frame_buffer[(y * texture_width * 4) + x * 4 + 3] = 1.0f; //Alpha
 }
 
+// Converts a whole width x height plane of values in one pass: negative values are drawn
+// in red and positive values in green, with an intensity of |value| * scale clamped to 255.
+// Pixels of a row are column_stride floats apart, the depth of a channel-last tensor.
+void set_values(const float *values, float scale, int column_stride = 1) const
+{
+        for(int y = 0; y < height; y++) {
+                const float *row = values + y * width * column_stride;
+                unsigned char *pixel = producer_frame_buffer + y * texture_width * 4;
+                for(int x = 0; x < width; x++) {
+                        float v = row[x * column_stride] * scale;
+                        v = (v > 255.0f) ? 255.0f : ((v < -255.0f) ? -255.0f : v);
+                        pixel[x * 4] = (unsigned char)((v < 0.0f) ? -v : 0.0f); // red
+                        pixel[x * 4 + 1] = (unsigned char)((v > 0.0f) ? v : 0.0f); // green
+                        pixel[x * 4 + 2] = 0;
+                        pixel[x * 4 + 3] = 1; // alpha
+                }
+        }
+}
+
 unsigned char getRed(int x, int y) const
 {
   assert(x >= 0 && y >= 0);
@@ -104,25 +134,29 @@ signed int getValue(int x, int y) const
         return negative_value + positive_valye;
 }
 
+// Publishes the frame drawn by the producer and gives it the spare buffer to draw the next one
 void swapBuffers()
 {
-        if(!is_consuming_frame_buffer) {
-                consumer_mutex.lock();
-                unsigned char *tmp = producer_frame_buffer;
-                producer_frame_buffer = consumer_frame_buffer;
-                consumer_frame_buffer = tmp;
-                consumer_mutex.unlock();
-        }
+        producer_index = spare_index.exchange(producer_index | FRAME_BUFFER_FRESH, memory_order_acq_rel) & FRAME_BUFFER_INDEX_MASK;
+        producer_frame_buffer = frame_buffers[producer_index];
 }
 
-~TensorRenderFrameBuffer() {
+// Called by the consumer before reading consumer_frame_buffer. Returns true if a newer frame
+// was taken; otherwise the consumer keeps the frame it already had.
+bool consume()
+{
+        if((spare_index.load(memory_order_relaxed) & FRAME_BUFFER_FRESH) == 0)
+                return false;
 
-        if(producer_frame_buffer != NULL) {
-                delete[] producer_frame_buffer;
-        }
+        consumer_index = spare_index.exchange(consumer_index, memory_order_acq_rel) & FRAME_BUFFER_INDEX_MASK;
+        consumer_frame_buffer = frame_buffers[consumer_index];
+        consumer_generation++;
+        return true;
+}
 
-        if(consumer_frame_buffer != NULL) {
-                delete[] consumer_frame_buffer;
+~TensorRenderFrameBuffer() {
+        for(int i = 0; i < 3; i++) {
+                free(frame_buffers[i]);
         }
 }
 
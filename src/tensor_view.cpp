@@ -0,0 +1,83 @@
+#ifndef _TENSOR_VIEW_CPP
+#define _TENSOR_VIEW_CPP
+
+#include <cassert>
+#include "tensor.cpp"
+
+namespace NeuralNetwork {
+
+// Non-owning view of a batch of tensors: a pointer, the shape and the strides of every
+// dimension in floats. Views are cheap to copy and never free their values, so layers
+// hand their activations and gradients to each other as views while each layer keeps
+// sole ownership of the TensorFloat it writes.
+class TensorView : public Tensor {
+
+public:
+
+float *values = NULL;
+int batch = 0;
+int column_stride = 0; // floats between (x, y) and (x + 1, y)
+int row_stride = 0; // floats between (x, y) and (x, y + 1)
+int plane_stride = 0; // floats between (x, y, z) and (x, y, z + 1)
+int sample_stride = 0; // floats between two samples
+
+TensorView() {
+
+}
+
+// Contiguous view of a dense batch, as stored by TensorFloat
+TensorView(float *values, size_tensor size, int batch, TensorLayout layout = layout_nchw) {
+        this->values = values;
+        this->size = size;
+        this->batch = batch;
+        this->layout = layout;
+        if(layout == layout_nhwc) {
+                column_stride = size.depth;
+                row_stride = size.width * size.depth;
+                plane_stride = 1;
+        } else {
+                column_stride = 1;
+                row_stride = size.width;
+                plane_stride = size.width * size.height;
+        }
+        sample_stride = sample_size();
+}
+
+// Number of values of a single sample
+int sample_size() const
+{
+        return size.width * size.height * size.depth;
+}
+
+// Number of values of all the samples
+int count() const
+{
+        return sample_size() * batch;
+}
+
+// True if the samples are stored one after another without gaps, so the values can be read as a flat array
+bool contiguous() const
+{
+        if(layout == layout_nhwc)
+                return column_stride == size.depth && row_stride == size.width * size.depth && plane_stride == 1 && sample_stride == sample_size();
+        return column_stride == 1 && row_stride == size.width && plane_stride == size.width * size.height && sample_stride == sample_size();
+}
+
+float* sample(int n) const
+{
+        assert(n >= 0 && n < batch);
+        return values + n * sample_stride;
+}
+
+float& get(int x, int y, int z, int n = 0) const
+{
+        assert(x >= 0 && y >= 0 && z >= 0 && n >= 0);
+        assert(x < size.width && y < size.height && z < size.depth && n < batch);
+        return values[n * sample_stride + z * plane_stride + y * row_stride + x * column_stride];
+}
+
+};
+
+}
+
+#endif
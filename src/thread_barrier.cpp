@@ -0,0 +1,42 @@
+#ifndef _THREAD_BARRIER_CPP
+#define _THREAD_BARRIER_CPP
+
+#include <mutex>
+#include <condition_variable>
+
+using namespace std;
+
+namespace NeuralNetwork {
+
+// Reusable barrier for a fixed number of threads
+class ThreadBarrier {
+
+public:
+
+int thread_count;
+int waiting = 0;
+int generation = 0;
+mutex barrier_mutex;
+condition_variable barrier_condition;
+
+ThreadBarrier(int count) {
+        thread_count = count;
+}
+
+void wait() {
+        unique_lock<mutex> lock(barrier_mutex);
+        int current_generation = generation;
+        if(++waiting == thread_count) {
+                waiting = 0;
+                generation++;
+                barrier_condition.notify_all();
+        } else {
+                barrier_condition.wait(lock, [&] { return current_generation != generation; });
+        }
+}
+
+};
+
+}
+
+#endif
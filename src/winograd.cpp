@@ -0,0 +1,154 @@
+#ifndef _WINOGRAD_CPP
+#define _WINOGRAD_CPP
+
+#include <algorithm>
+#include "common.cpp"
+
+namespace NeuralNetwork {
+
+// Winograd minimal filtering F(m x m, 3 x 3). An m x m output tile of a 3 x 3 convolution
+// is A^T [(G g G^T) .* (B^T d B)] A, where d is the (m + 2) x (m + 2) input tile and g the
+// filter, so the 9 m^2 multiplies per tile, channel and filter of the direct loop become
+// (m + 2)^2. The transforms are separable, each one runs its 1D form down the columns and
+// then along the rows of the tile.
+template<int M> struct Winograd;
+
+template<> struct Winograd<2> {
+
+static const int ALPHA = 4;
+
+// B^T d
+static inline void input(const float *d, int s, float *out, int os) {
+        out[0] = d[0] - d[2 * s];
+        out[os] = d[s] + d[2 * s];
+        out[2 * os] = d[2 * s] - d[s];
+        out[3 * os] = d[s] - d[3 * s];
+}
+
+// G g
+static inline void filter(const float *g, int s, float *out, int os) {
+        out[0] = g[0];
+        out[os] = 0.5f * (g[0] + g[s] + g[2 * s]);
+        out[2 * os] = 0.5f * (g[0] - g[s] + g[2 * s]);
+        out[3 * os] = g[2 * s];
+}
+
+// A^T m
+static inline void output(const float *m, int s, float *out, int os) {
+        out[0] = m[0] + m[s] + m[2 * s];
+        out[os] = m[s] - m[2 * s] - m[3 * s];
+}
+
+};
+
+template<> struct Winograd<4> {
+
+static const int ALPHA = 6;
+
+static inline void input(const float *d, int s, float *out, int os) {
+        out[0] = 4.0f * d[0] - 5.0f * d[2 * s] + d[4 * s];
+        out[os] = -4.0f * (d[s] + d[2 * s]) + d[3 * s] + d[4 * s];
+        out[2 * os] = 4.0f * (d[s] - d[2 * s]) - d[3 * s] + d[4 * s];
+        out[3 * os] = 2.0f * (d[3 * s] - d[s]) - d[2 * s] + d[4 * s];
+        out[4 * os] = 2.0f * (d[s] - d[3 * s]) - d[2 * s] + d[4 * s];
+        out[5 * os] = 4.0f * d[s] - 5.0f * d[3 * s] + d[5 * s];
+}
+
+static inline void filter(const float *g, int s, float *out, int os) {
+        out[0] = g[0] / 4.0f;
+        out[os] = -(g[0] + g[s] + g[2 * s]) / 6.0f;
+        out[2 * os] = -(g[0] - g[s] + g[2 * s]) / 6.0f;
+        out[3 * os] = g[0] / 24.0f + g[s] / 12.0f + g[2 * s] / 6.0f;
+        out[4 * os] = g[0] / 24.0f - g[s] / 12.0f + g[2 * s] / 6.0f;
+        out[5 * os] = g[2 * s];
+}
+
+static inline void output(const float *m, int s, float *out, int os) {
+        float a = m[s] + m[2 * s], b = m[s] - m[2 * s];
+        float c = m[3 * s] + m[4 * s], d = m[3 * s] - m[4 * s];
+        out[0] = m[0] + a + c;
+        out[os] = b + 2.0f * d;
+        out[2 * os] = a + 4.0f * c;
+        out[3 * os] = b + 8.0f * d + m[5 * s];
+}
+
+};
+
+// Transforms a 3 x 3 filter, stored as in a filter TensorFloat, into u, which holds the
+// (m + 2) x (m + 2) transformed tile of every input channel: u[z * (m + 2)^2 + e]
+template<int M>
+static void winograd_filter(const float *filter, int depth, float *u)
+{
+        const int A = Winograd<M>::ALPHA;
+        float columns[A * 3];
+
+        for(int z = 0; z < depth; z++) {
+                const float *g = filter + z * 9;
+                for(int i = 0; i < 3; i++)
+                        Winograd<M>::filter(g + i, 3, columns + i, 3);
+                for(int r = 0; r < A; r++)
+                        Winograd<M>::filter(columns + r * 3, 1, u + z * A * A + r * A, 1);
+        }
+}
+
+// Transforms the input tile at (x0, y0) of every channel of a sample into v, laid out as
+// the transformed filters. Reads zeros outside the input, which covers the padding and
+// the tiles past the border.
+template<int M>
+static void winograd_input(const float *in, size_tensor in_size, int x0, int y0, float *v)
+{
+        const int A = Winograd<M>::ALPHA;
+        int in_area = in_size.width * in_size.height;
+        bool inside = x0 >= 0 && y0 >= 0 && x0 + A <= in_size.width && y0 + A <= in_size.height;
+        float d[A * A], columns[A * A];
+
+        for(int z = 0; z < in_size.depth; z++) {
+                const float *plane = in + z * in_area;
+                if(inside) {
+                        for(int r = 0; r < A; r++)
+                                for(int c = 0; c < A; c++)
+                                        d[r * A + c] = plane[(y0 + r) * in_size.width + x0 + c];
+                } else {
+                        for(int r = 0; r < A; r++) {
+                                for(int c = 0; c < A; c++) {
+                                        int x = x0 + c, y = y0 + r;
+                                        d[r * A + c] = (x >= 0 && x < in_size.width && y >= 0 && y < in_size.height) ? plane[y * in_size.width + x] : 0.0f;
+                                }
+                        }
+                }
+
+                for(int c = 0; c < A; c++)
+                        Winograd<M>::input(d + c, A, columns + c, A);
+                for(int r = 0; r < A; r++)
+                        Winograd<M>::input(columns + r * A, 1, v + z * A * A + r * A, 1);
+        }
+}
+
+// Elementwise products of a transformed filter and input tile, summed over the channels,
+// followed by the output transform into the m x m tile of the output map at (x0, y0).
+// Tile outputs past the border are dropped.
+template<int M>
+static void winograd_output(const float *u, const float *v, int depth, float *map, int out_width, int out_height, int x0, int y0)
+{
+        const int A = Winograd<M>::ALPHA;
+        float m[A * A] = {0}, columns[M * A], y[M * M];
+
+        for(int z = 0; z < depth; z++) {
+                for(int e = 0; e < A * A; e++)
+                        m[e] += u[z * A * A + e] * v[z * A * A + e];
+        }
+
+        for(int c = 0; c < A; c++)
+                Winograd<M>::output(m + c, A, columns + c, A);
+        for(int r = 0; r < M; r++)
+                Winograd<M>::output(columns + r * A, 1, y + r * M, 1);
+
+        int rows = std::min(M, out_height - y0), cols = std::min(M, out_width - x0);
+        for(int r = 0; r < rows; r++)
+                for(int c = 0; c < cols; c++)
+                        map[(y0 + r) * out_width + x0 + c] = y[r * M + c];
+}
+
+}
+
+#endif
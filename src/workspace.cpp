@@ -0,0 +1,65 @@
+#ifndef _WORKSPACE_CPP
+#define _WORKSPACE_CPP
+
+#include <cassert>
+#include <vector>
+#include "common.cpp"
+#include "layer.cpp"
+#include "tensor_float.cpp"
+
+using namespace std;
+
+namespace NeuralNetwork {
+
+// Per-step memory of a chain of layers. Planning sizes every layer for the batch and
+// reserves the scratch memory they ask for in a single aligned arena, so a training step
+// on the planned batch size does no heap allocation.
+// Every thread running its own chain of layers needs its own workspace.
+class Workspace {
+
+public:
+
+int batch_size = 0;
+float *arena = NULL;
+int arena_size = 0; // floats
+
+Workspace(vector<Layer*> &layers, int batch_size) {
+        plan(layers, batch_size);
+}
+
+// Called at topology build time, and again only if the batch size changes
+void plan(vector<Layer*> &layers, int batch_size) {
+        this->batch_size = batch_size;
+
+        int size = 0;
+        for(Layer *layer: layers) {
+                if(layer->batch_size != batch_size)
+                        layer->set_batch_size(batch_size);
+                size += aligned_count(layer->workspace_size());
+        }
+
+        if(size > arena_size) {
+                if(arena != NULL)
+                        aligned_float_free(arena);
+                arena = aligned_float_alloc(size);
+                arena_size = size;
+        }
+
+        // the scratch of every layer lives from its activate() to its calc_grads(), so the regions do not overlap
+        float *region = arena;
+        for(Layer *layer: layers) {
+                layer->bind_workspace(region);
+                region += aligned_count(layer->workspace_size());
+        }
+}
+
+~Workspace() {
+        if(arena != NULL)
+                aligned_float_free(arena);
+}
+
+};
+
+}
+
+#endif
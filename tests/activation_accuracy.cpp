@@ -0,0 +1,106 @@
+#include <vector>
+#include "check.cpp"
+#include "../src/optimizer.cpp"
+#include "../src/fully_connected_layer.cpp"
+#include "../src/workspace.cpp"
+
+// Checks the polynomial exp() of the activation kernels, and the sigmoid and tanh built on
+// it, against libm in double precision, on the vector loops and on their scalar tails. Then
+// checks a tanh fully connected layer against the same math in double precision.
+
+#define CHECK_POINTS 100003 // not a multiple of the vector width, so the tail runs too
+#define EXP_TOLERANCE 2e-7 // relative error
+#define ACTIVATION_TOLERANCE 5e-7 // absolute error, sigmoid and tanh are bounded by 1
+#define LAYER_TOLERANCE 1e-5 // relative to the largest value
+#define CHECK_BATCH 3
+
+static vector<float> range(float low, float high)
+{
+        vector<float> x(CHECK_POINTS);
+        for(int i = 0; i < CHECK_POINTS; i++)
+                x[i] = low + (high - low) * i / (CHECK_POINTS - 1);
+        return x;
+}
+
+static void check_exp()
+{
+        vector<float> x = range(EXP_MIN_INPUT, EXP_MAX_INPUT), y(CHECK_POINTS);
+        float vector_error = 0, scalar_error = 0;
+        int i = 0;
+#if defined(__GNUC__)
+        for(; i + ACTIVATION_VECTOR_WIDTH <= CHECK_POINTS; i += ACTIVATION_VECTOR_WIDTH) {
+                activation_store(y.data() + i, fast_exp(activation_load(x.data() + i)));
+                for(int l = i; l < i + ACTIVATION_VECTOR_WIDTH; l++)
+                        vector_error = fmax(vector_error, fabs(y[l] / exp((double)x[l]) - 1.0));
+        }
+#endif
+        for(int l = 0; l < CHECK_POINTS; l++)
+                scalar_error = fmax(scalar_error, fabs(fast_exp(x[l]) / exp((double)x[l]) - 1.0));
+        check("vector exp, relative error", vector_error, EXP_TOLERANCE);
+        check("scalar exp, relative error", scalar_error, EXP_TOLERANCE);
+}
+
+static void check_sigmoid_and_tanh()
+{
+        vector<float> x = range(-20.0f, 20.0f), y(CHECK_POINTS);
+        float sigmoid_error = 0, tanh_error = 0;
+        sigmoid_forward(x.data(), y.data(), CHECK_POINTS);
+        for(int i = 0; i < CHECK_POINTS; i++)
+                sigmoid_error = fmax(sigmoid_error, fabs(y[i] - 1.0 / (1.0 + exp(-(double)x[i]))));
+        tanh_forward(x.data(), y.data(), CHECK_POINTS);
+        for(int i = 0; i < CHECK_POINTS; i++)
+                tanh_error = fmax(tanh_error, fabs(y[i] - tanh((double)x[i])));
+        check("sigmoid, absolute error", sigmoid_error, ACTIVATION_TOLERANCE);
+        check("tanh, absolute error", tanh_error, ACTIVATION_TOLERANCE);
+}
+
+// Forward and backward pass of a tanh layer against tanh(W x) and W^T (grad * (1 - y^2))
+static void check_tanh_layer()
+{
+        srand(13);
+        SgdOptimizer optimizer(0.01f, 0.6f, 0.001f);
+        FullyConnectedLayer layer({7, 5, 3}, {12, 1, 1}, tanh_activation);
+        layer.optimizer = &optimizer;
+        vector<Layer*> layers = {&layer};
+        Workspace workspace(layers, CHECK_BATCH);
+
+        TensorFloat in(7, 5, 3, CHECK_BATCH), grad(12, 1, 1, CHECK_BATCH);
+        fill_random(in, -1.0f, 1.0f);
+        fill_random(grad, -1.0f, 1.0f);
+        vector<float> weights(layer.weights->values, layer.weights->values + layer.weights->count()); // calc_grads updates them
+        layer.activate(in.view());
+        layer.calc_grads(grad.view());
+
+        int inputs = layer.input_count, outputs = layer.output_size.width;
+        double output_error = 0, largest_output = 0, gradient_error = 0, largest_gradient = 0;
+        for(int n = 0; n < CHECK_BATCH; n++) {
+                vector<double> deltas(outputs);
+                for(int o = 0; o < outputs; o++) {
+                        double sum = 0;
+                        for(int i = 0; i < inputs; i++)
+                                sum += (double)weights[o * layer.row_stride + i] * in.sample(n)[i];
+                        double y = tanh(sum);
+                        deltas[o] = grad.sample(n)[o] * (1.0 - y * y);
+                        output_error = fmax(output_error, fabs(layer.output->sample(n)[o] - y));
+                        largest_output = fmax(largest_output, fabs(y));
+                }
+                for(int i = 0; i < inputs; i++) {
+                        double sum = 0;
+                        for(int o = 0; o < outputs; o++)
+                                sum += weights[o * layer.row_stride + i] * deltas[o];
+                        gradient_error = fmax(gradient_error, fabs(layer.input_gradients->sample(n)[i] - sum));
+                        largest_gradient = fmax(largest_gradient, fabs(sum));
+                }
+        }
+        check("tanh fully connected layer: output", output_error / largest_output, LAYER_TOLERANCE);
+        check("tanh fully connected layer: input gradients", gradient_error / largest_gradient, LAYER_TOLERANCE);
+}
+
+int main()
+{
+        check_exp();
+        check_sigmoid_and_tanh();
+        check_tanh_layer();
+
+        return check_failures;
+}
@@ -0,0 +1,52 @@
+#ifndef _CHECK_CPP
+#define _CHECK_CPP
+
+#include <iostream>
+#include <cmath>
+#include <cstdlib>
+#include "../src/tensor_float.cpp"
+
+using namespace std;
+using namespace NeuralNetwork;
+
+// Harness of the headless checks run by ctest: every check prints the error it measured
+// and main() returns the number of checks over their tolerance, so any of them fails the test.
+static int check_failures = 0;
+
+static void check(const char *what, double error, double tolerance)
+{
+        bool ok = error <= tolerance; // NaN fails too
+        cout << (ok ? "ok    " : "FAIL  ") << what << ": " << error << " (tolerance " << tolerance << ")" << endl;
+        check_failures += !ok;
+}
+
+static void fill_random(TensorFloat &t, float low, float high)
+{
+        for(int i = 0; i < t.count(); i++)
+                t.values[i] = low + (high - low) * rand() / float( RAND_MAX );
+}
+
+// Copies the values of a tensor into one of the same size in another layout
+static void copy_positions(const TensorFloat &from, TensorFloat &to)
+{
+        for(int n = 0; n < from.batch; n++)
+                for(int z = 0; z < from.size.depth; z++)
+                        for(int y = 0; y < from.size.height; y++)
+                                for(int x = 0; x < from.size.width; x++)
+                                        to.get(x, y, z, n) = from.get(x, y, z, n);
+}
+
+// Largest difference between two batches of the same size, compared position by position
+// so the tensors may have different layouts
+static float max_difference(const TensorFloat &a, const TensorFloat &b)
+{
+        float difference = 0;
+        for(int n = 0; n < a.batch; n++)
+                for(int z = 0; z < a.size.depth; z++)
+                        for(int y = 0; y < a.size.height; y++)
+                                for(int x = 0; x < a.size.width; x++)
+                                        difference = fmax(difference, fabs(a.get(x, y, z, n) - b.get(x, y, z, n)));
+        return difference;
+}
+
+#endif
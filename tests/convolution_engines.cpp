@@ -0,0 +1,107 @@
+#include <vector>
+#include "check.cpp"
+#include "../src/convolutional_layer.cpp"
+#include "../src/workspace.cpp"
+
+// Checks every convolution engine against the planar direct loop on random inputs, on both
+// layouts: the outputs of the forward pass, and the input and filter gradients of the
+// backward pass.
+
+#define ENGINE_TOLERANCE 1e-5 // largest difference relative to the largest value of the direct loop
+
+struct ConvolutionShape
+{
+        int width, height, depth;
+        int extend_filter, stride, padding;
+        int filters;
+};
+
+static const ConvolutionShape shapes[] = {
+        {28, 28, 1, 5, 1, 0, 8}, // first MNIST convolution
+        {12, 12, 8, 3, 1, 0, 10}, // second one of the alternative topology
+        {12, 12, 8, 5, 1, 2, 16},
+        {9, 9, 2, 3, 1, 1, 5},
+        {13, 6, 3, 3, 1, 0, 7},
+        {11, 11, 2, 5, 2, 2, 5},
+        {10, 7, 3, 3, 2, 1, 4},
+        {6, 6, 17, 2, 2, 1, 9},
+};
+
+#define CHECK_BATCH 3
+
+static float largest_value(const TensorFloat &t)
+{
+        float largest = 0;
+        for(int i = 0; i < t.count(); i++)
+                largest = fmax(largest, fabs(t.values[i]));
+        return largest;
+}
+
+// Runs a forward and a backward pass of a layer with the given engine and layout and of a
+// planar direct layer with the same filters, on the same batch of inputs and output
+// gradients. The Winograd engine takes the width of its output tiles.
+static void compare_with_direct(const char *engine_name, const ConvolutionShape &s, ConvolutionEngine engine,
+                                TensorLayout layout = layout_nchw, int winograd_tile = 0)
+{
+        size_tensor in_size = {s.width, s.height, s.depth};
+        srand(7);
+        ConvolutionalLayer direct(s.stride, s.extend_filter, s.filters, in_size, s.padding);
+        direct.engine = conv_direct;
+        srand(7);
+        ConvolutionalLayer layer(s.stride, s.extend_filter, s.filters, in_size, s.padding);
+        layer.engine = engine;
+        if(engine == conv_winograd)
+                layer.use_winograd(winograd_tile);
+        bool layout_set = layer.set_layout(layout);
+        assert(layout_set);
+
+        TensorFloat in(s.width, s.height, s.depth, CHECK_BATCH);
+        fill_random(in, -1.0f, 1.0f);
+        size_tensor out_size = direct.output->size;
+        TensorFloat grad(out_size.width, out_size.height, out_size.depth, CHECK_BATCH);
+        fill_random(grad, -1.0f, 1.0f);
+        TensorFloat layer_in(s.width, s.height, s.depth, CHECK_BATCH, layout);
+        TensorFloat layer_grad(out_size.width, out_size.height, out_size.depth, CHECK_BATCH, layout);
+        copy_positions(in, layer_in);
+        copy_positions(grad, layer_grad);
+
+        vector<Layer*> direct_layers = {&direct}, engine_layers = {&layer};
+        Workspace direct_workspace(direct_layers, CHECK_BATCH), engine_workspace(engine_layers, CHECK_BATCH);
+        direct.activate(in.view());
+        direct.calc_grads(grad.view());
+        layer.activate(layer_in.view());
+        layer.calc_grads(layer_grad.view());
+
+        float filter_error = 0, largest_filter_gradient = 0;
+        for(int k = 0; k < s.filters; k++) {
+                for(int i = 0; i < direct.filter_gradients[k]->count(); i++) {
+                        filter_error = fmax(filter_error, fabs(layer.filter_gradients[k]->grad[i] - direct.filter_gradients[k]->grad[i]));
+                        largest_filter_gradient = fmax(largest_filter_gradient, fabs(direct.filter_gradients[k]->grad[i]));
+                }
+        }
+
+        char what[120];
+        int length = snprintf(what, sizeof(what), "%s %dx%dx%d, %dx%d filters, stride %d, padding %d: ",
+                              engine_name, s.width, s.height, s.depth, s.extend_filter, s.extend_filter, s.stride, s.padding);
+        snprintf(what + length, sizeof(what) - length, "output");
+        check(what, max_difference(*layer.output, *direct.output) / largest_value(*direct.output), ENGINE_TOLERANCE);
+        snprintf(what + length, sizeof(what) - length, "input gradients");
+        check(what, max_difference(*layer.input_gradients, *direct.input_gradients) / largest_value(*direct.input_gradients), ENGINE_TOLERANCE);
+        snprintf(what + length, sizeof(what) - length, "filter gradients");
+        check(what, filter_error / largest_filter_gradient, ENGINE_TOLERANCE);
+}
+
+int main()
+{
+        for(const ConvolutionShape &s: shapes) {
+                compare_with_direct("im2col + GEMM", s, conv_im2col_gemm);
+                compare_with_direct("NHWC direct", s, conv_direct, layout_nhwc);
+                compare_with_direct("NHWC im2row + GEMM", s, conv_im2col_gemm, layout_nhwc);
+                if(s.extend_filter == 3 && s.stride == 1) {
+                        compare_with_direct("Winograd F(2x2,3x3)", s, conv_winograd, layout_nchw, 2);
+                        compare_with_direct("Winograd F(4x4,3x3)", s, conv_winograd, layout_nchw, 4);
+                }
+        }
+
+        return check_failures;
+}
@@ -0,0 +1,99 @@
+#include <vector>
+#include <cstring>
+#include "check.cpp"
+#include "../src/optimizer.cpp"
+#include "../src/convolutional_layer.cpp"
+#include "../src/relu_layer.cpp"
+#include "../src/pool_layer.cpp"
+#include "../src/fully_connected_layer.cpp"
+#include "../src/softmax_cross_entropy_layer.cpp"
+#include "../src/workspace.cpp"
+#include "../src/data_parallel_trainer.cpp"
+
+// Trains the same network on the same batches with a single thread and with the
+// DataParallelTrainer. The trainer must give the same weights as the single thread up to
+// the order of the gradient sums, and bit-identical weights for a given thread count.
+
+#define CHECK_BATCH 6
+#define CHECK_STEPS 20
+#define REDUCTION_TOLERANCE 1e-5 // largest weight difference relative to the largest weight
+
+static vector<Layer*> build_network(Optimizer *optimizer)
+{
+        srand(11);
+        ConvolutionalLayer *conv = new ConvolutionalLayer(1, 5, 4, {12, 12, 1}); // 12 * 12 * 1 -> 8 * 8 * 4
+        ReLuLayer *relu = new ReLuLayer(conv->output->size);
+        PoolLayer *pool = new PoolLayer(2, 2, relu->output->size); // -> 4 * 4 * 4
+        FullyConnectedLayer *fc = new FullyConnectedLayer(pool->output->size, {10, 1, 1}, linear_activation);
+        SoftmaxCrossEntropyLayer *loss = new SoftmaxCrossEntropyLayer(fc->output->size);
+        vector<Layer*> layers = {conv, relu, pool, fc, loss};
+        for(Layer *layer: layers)
+                layer->optimizer = optimizer;
+        return layers;
+}
+
+// Weights of the network as a flat vector, filters first
+static vector<float> train_network(int threads)
+{
+        SgdOptimizer optimizer(0.01f, 0.6f, 0.001f);
+        vector<Layer*> layers = build_network(&optimizer);
+        DataParallelTrainer *trainer = threads > 0 ? new DataParallelTrainer(layers, threads, CHECK_BATCH) : NULL;
+        Workspace *workspace = threads > 0 ? NULL : new Workspace(layers, CHECK_BATCH); // the trainer plans the replicas itself
+
+        srand(5);
+        TensorFloat data(12, 12, 1, CHECK_BATCH), expected(10, 1, 1, CHECK_BATCH);
+        for(int step = 0; step < CHECK_STEPS; step++) {
+                fill_random(data, 0.0f, 1.0f);
+                memset(expected.values, 0, expected.count() * sizeof(float));
+                for(int n = 0; n < CHECK_BATCH; n++)
+                        expected.sample(n)[rand() % 10] = 1.0f;
+
+                if(trainer != NULL) {
+                        trainer->train(&data, &expected);
+                        continue;
+                }
+                for(int i = 0; i < layers.size(); i++)
+                        layers[i]->activate(i == 0 ? data.view() : layers[i - 1]->output->view());
+                for(int i = layers.size() - 1; i >= 0; i--)
+                        layers[i]->calc_grads(i == layers.size() - 1 ? expected.view() : layers[i + 1]->input_gradients->view());
+                for(Layer *layer: layers)
+                        layer->fix_weights();
+        }
+        delete trainer;
+        delete workspace;
+
+        vector<float> weights;
+        for(TensorFloat *filter: ((ConvolutionalLayer*)layers[0])->filters)
+                weights.insert(weights.end(), filter->values, filter->values + filter->count());
+        TensorFloat *fc_weights = ((FullyConnectedLayer*)layers[3])->weights;
+        weights.insert(weights.end(), fc_weights->values, fc_weights->values + fc_weights->count());
+
+        for(Layer *layer: layers)
+                delete layer;
+        return weights;
+}
+
+static float relative_difference(const vector<float> &a, const vector<float> &b)
+{
+        float difference = 0, largest = 0;
+        for(int i = 0; i < a.size(); i++) {
+                difference = fmax(difference, fabs(a[i] - b[i]));
+                largest = fmax(largest, fabs(b[i]));
+        }
+        return difference / largest;
+}
+
+int main()
+{
+        vector<float> single = train_network(0);
+        char what[100];
+        for(int threads = 1; threads <= 4; threads++) {
+                vector<float> first = train_network(threads), second = train_network(threads);
+                snprintf(what, sizeof(what), "%d threads against a single thread", threads);
+                check(what, relative_difference(first, single), REDUCTION_TOLERANCE);
+                snprintf(what, sizeof(what), "%d threads, two runs", threads);
+                check(what, relative_difference(first, second), 0);
+        }
+
+        return check_failures;
+}
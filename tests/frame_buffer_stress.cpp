@@ -0,0 +1,94 @@
+#include <cstring>
+#include <thread>
+#include <chrono>
+#include "check.cpp"
+#include "../src/tensor_render_frame_buffer.cpp"
+
+// Hammers the triple buffer of the render frame buffers from a producer and a consumer
+// thread. Every frame is filled with its number, so a frame the consumer reads while the
+// producer writes into it shows up as a mix of numbers (torn). The producer must never wait
+// for the consumer, neither a busy one nor one that stops consuming.
+
+#define CHECK_FRAMES 20000
+#define CONSUMER_READS 8 // passes of the consumer over every frame it takes, to keep it busy
+
+static void draw_frame(TensorRenderFrameBuffer &buffer, unsigned int frame)
+{
+        unsigned int *pixels = (unsigned int *)buffer.producer_frame_buffer;
+        for(int i = 0; i < buffer.texture_width * buffer.texture_height; i++)
+                pixels[i] = frame;
+}
+
+// Number of the frame held by the consumer, or 0 if its pixels are not all the same
+static unsigned int consumed_frame(const TensorRenderFrameBuffer &buffer)
+{
+        const unsigned int *pixels = (const unsigned int *)buffer.consumer_frame_buffer;
+        for(int i = 1; i < buffer.texture_width * buffer.texture_height; i++)
+                if(pixels[i] != pixels[0])
+                        return 0;
+        return pixels[0];
+}
+
+// Publishes CHECK_FRAMES frames and returns the longest swap in microseconds
+static double produce(TensorRenderFrameBuffer &buffer, atomic<bool> &done)
+{
+        double longest_swap = 0;
+        for(unsigned int frame = 1; frame <= CHECK_FRAMES; frame++) {
+                draw_frame(buffer, frame);
+                auto start = chrono::steady_clock::now();
+                buffer.swapBuffers();
+                longest_swap = fmax(longest_swap, chrono::duration<double, micro>(chrono::steady_clock::now() - start).count());
+                this_thread::yield(); // lets the consumer in between the frames on a single core too
+        }
+        done = true;
+        return longest_swap;
+}
+
+int main()
+{
+        TensorRenderFrameBuffer buffer(28, 28);
+        atomic<bool> done(false);
+        double longest_swap = 0;
+        thread producer([&]{ longest_swap = produce(buffer, done); });
+
+        int taken = 0, torn = 0, out_of_order = 0;
+        unsigned int last_frame = 0;
+        while(true) {
+                bool finished = done.load();
+                if(!buffer.consume()) {
+                        if(finished)
+                                break;
+                        continue;
+                }
+                taken++;
+                unsigned int frame = consumed_frame(buffer);
+                for(int pass = 1; pass < CONSUMER_READS; pass++)
+                        if(consumed_frame(buffer) != frame)
+                                frame = 0;
+                if(frame == 0) {
+                        torn++;
+                        continue;
+                }
+                out_of_order += frame <= last_frame;
+                last_frame = frame;
+        }
+        producer.join();
+        cout << "busy consumer took " << taken << " of " << CHECK_FRAMES << " frames, longest swap " << longest_swap << " us" << endl;
+        check("torn frames", torn, 0);
+        check("frames older than the previous one", out_of_order, 0);
+        check("frames missing after the last one taken", CHECK_FRAMES - last_frame, 0);
+
+        // The consumer holds its frame and takes nothing while the producer publishes all of
+        // them: the producer must finish, and the consumer then gets the latest frame
+        TensorRenderFrameBuffer idle_buffer(28, 28);
+        atomic<bool> idle_done(false);
+        idle_buffer.consume();
+        unsigned int held_frame = consumed_frame(idle_buffer);
+        thread idle_producer([&]{ longest_swap = produce(idle_buffer, idle_done); });
+        idle_producer.join();
+        cout << "idle consumer, longest swap " << longest_swap << " us" << endl;
+        check("held frame overwritten by the producer", consumed_frame(idle_buffer) != held_frame, 0);
+        check("frames missing after an idle consumer", idle_buffer.consume() ? CHECK_FRAMES - consumed_frame(idle_buffer) : CHECK_FRAMES, 0);
+
+        return check_failures;
+}
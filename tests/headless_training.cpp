@@ -0,0 +1,69 @@
+#include <vector>
+#include <cstring>
+#include "check.cpp"
+#include "../src/optimizer.cpp"
+#include "../src/convolutional_layer.cpp"
+#include "../src/relu_layer.cpp"
+#include "../src/pool_layer.cpp"
+#include "../src/fully_connected_layer.cpp"
+#include "../src/softmax_cross_entropy_layer.cpp"
+#include "../src/workspace.cpp"
+
+// Trains the MNIST topology of the headless build on a toy task, with every step taking a
+// snapshot: no layer may own render buffers, the render hooks must do nothing, and the
+// network must still learn. The task is telling whether the bright half of the image is
+// the left or the right one.
+
+#define CHECK_STEPS 300
+#define CHECK_WINDOW 50 // steps averaged at the start and at the end
+
+int main()
+{
+        srand(3);
+        SgdOptimizer optimizer(0.01f, 0.6f, 0.001f);
+        ConvolutionalLayer *conv = new ConvolutionalLayer(1, 5, 8, {28, 28, 1}); // 28 * 28 * 1 -> 24 * 24 * 8
+        ReLuLayer *relu = new ReLuLayer(conv->output->size);
+        PoolLayer *pool = new PoolLayer(2, 2, relu->output->size); // -> 12 * 12 * 8
+        FullyConnectedLayer *fc = new FullyConnectedLayer(pool->output->size, {10, 1, 1}, linear_activation);
+        SoftmaxCrossEntropyLayer *loss = new SoftmaxCrossEntropyLayer(fc->output->size);
+        vector<Layer*> layers = {conv, relu, pool, fc, loss};
+
+        int render_buffers = 0;
+        for(Layer *layer: layers) {
+                layer->optimizer = &optimizer;
+                layer->snapshot = true;
+                render_buffers += layer->gridRenderFrameBuffer != NULL;
+        }
+        check("layers with render buffers", render_buffers, 0);
+
+        Workspace workspace(layers, 1);
+        TensorFloat data(28, 28, 1), expected(10, 1, 1);
+        float first_loss = 0, last_loss = 0;
+        for(int step = 0; step < CHECK_STEPS; step++) {
+                int label = rand() % 2;
+                fill_random(data, 0.0f, 0.3f);
+                for(int y = 0; y < 28; y++)
+                        for(int x = label * 14; x < label * 14 + 14; x++)
+                                data(x, y, 0) += 0.7f;
+                memset(expected.values, 0, expected.count() * sizeof(float));
+                expected.values[label] = 1.0f;
+
+                for(int i = 0; i < layers.size(); i++)
+                        layers[i]->activate(i == 0 ? data.view() : layers[i - 1]->output->view());
+                for(int i = layers.size() - 1; i >= 0; i--)
+                        layers[i]->calc_grads(i == layers.size() - 1 ? expected.view() : layers[i + 1]->input_gradients->view());
+                for(Layer *layer: layers)
+                        layer->fix_weights();
+
+                if(step < CHECK_WINDOW)
+                        first_loss += loss->loss / CHECK_WINDOW;
+                if(step >= CHECK_STEPS - CHECK_WINDOW)
+                        last_loss += loss->loss / CHECK_WINDOW;
+        }
+        cout << "mean cross entropy of the first and last " << CHECK_WINDOW << " steps: " << first_loss << ", " << last_loss << endl;
+        check("last loss relative to the first one", last_loss / first_loss, 0.25);
+
+        for(Layer *layer: layers)
+                delete layer;
+        return check_failures;
+}
@@ -0,0 +1,63 @@
+#include <vector>
+#include "check.cpp"
+#include "../src/pool_layer.cpp"
+#include "../src/workspace.cpp"
+
+// Checks the channel-last pool kernels against the planar ones on random inputs: the
+// outputs of the forward pass and the input gradients of the backward pass. Both take the
+// maximum of the same windows, so they must agree exactly.
+
+#define CHECK_BATCH 3
+
+struct PoolShape
+{
+        int width, height, depth;
+        int extend_filter, stride, padding;
+};
+
+static const PoolShape shapes[] = {
+        {24, 24, 8, 2, 2, 0}, // MNIST pool, the kernel unrolled for 2 x 2 windows
+        {9, 9, 16, 2, 2, 1},
+        {12, 10, 5, 3, 2, 1},
+        {7, 7, 3, 3, 1, 0},
+};
+
+static void compare_layouts(const PoolShape &s)
+{
+        size_tensor in_size = {s.width, s.height, s.depth};
+        PoolLayer planar(s.stride, s.extend_filter, in_size, s.padding);
+        PoolLayer channels_last(s.stride, s.extend_filter, in_size, s.padding);
+        channels_last.set_layout(layout_nhwc);
+
+        size_tensor out_size = planar.output->size;
+        TensorFloat in(s.width, s.height, s.depth, CHECK_BATCH), grad(out_size.width, out_size.height, out_size.depth, CHECK_BATCH);
+        fill_random(in, -1.0f, 1.0f);
+        fill_random(grad, -1.0f, 1.0f);
+        TensorFloat in_nhwc(s.width, s.height, s.depth, CHECK_BATCH, layout_nhwc);
+        TensorFloat grad_nhwc(out_size.width, out_size.height, out_size.depth, CHECK_BATCH, layout_nhwc);
+        copy_positions(in, in_nhwc);
+        copy_positions(grad, grad_nhwc);
+
+        vector<Layer*> planar_layers = {&planar}, channels_last_layers = {&channels_last};
+        Workspace planar_workspace(planar_layers, CHECK_BATCH), channels_last_workspace(channels_last_layers, CHECK_BATCH);
+        planar.activate(in.view());
+        planar.calc_grads(grad.view());
+        channels_last.activate(in_nhwc.view());
+        channels_last.calc_grads(grad_nhwc.view());
+
+        char what[100];
+        int length = snprintf(what, sizeof(what), "NHWC pool %dx%dx%d, %dx%d windows, stride %d, padding %d: ",
+                              s.width, s.height, s.depth, s.extend_filter, s.extend_filter, s.stride, s.padding);
+        snprintf(what + length, sizeof(what) - length, "output");
+        check(what, max_difference(*channels_last.output, *planar.output), 0);
+        snprintf(what + length, sizeof(what) - length, "input gradients");
+        check(what, max_difference(*channels_last.input_gradients, *planar.input_gradients), 0);
+}
+
+int main()
+{
+        for(const PoolShape &s: shapes)
+                compare_layouts(s);
+
+        return check_failures;
+}
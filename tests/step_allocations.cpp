@@ -0,0 +1,163 @@
+#include <vector>
+#include <cstring>
+#include <algorithm>
+#include "check.cpp"
+#include "../src/common.cpp"
+#include "../src/optimizer.cpp"
+#include "../src/convolutional_layer.cpp"
+#include "../src/relu_layer.cpp"
+#include "../src/pool_layer.cpp"
+#include "../src/conv_relu_pool_layer.cpp"
+#include "../src/fully_connected_layer.cpp"
+#include "../src/softmax_cross_entropy_layer.cpp"
+#include "../src/workspace.cpp"
+#include "../src/data_parallel_trainer.cpp"
+#include "../src/hogwild_trainer.cpp"
+
+// Built with TENSAR_COUNT_ALLOCATIONS: once a few warm-up steps have grown the thread_local
+// GEMM pack buffers of every training thread, a training step must not allocate, case by
+// case, on a batch, with the DataParallelTrainer and with the HogwildTrainer. The network
+// covers the fused, the im2col + GEMM, the Winograd and the fully connected kernels.
+
+#define WARMUP_STEPS 3
+#define CHECK_STEPS 20
+#define CHECK_THREADS 3
+#define HOGWILD_CHUNK 12 // cases of a Hogwild step
+#define HOGWILD_WARMUP_LIMIT 1000 // steps waiting for every Hogwild thread to train a case
+
+struct CheckNetwork
+{
+        vector<Layer*> layers; // as built, owns the layers
+        vector<Layer*> network; // what trains, with conv, relu and pool fused
+};
+
+static CheckNetwork build_network(Optimizer *optimizer)
+{
+        srand(17);
+        CheckNetwork net;
+        ConvolutionalLayer *conv1 = new ConvolutionalLayer(1, 5, 8, {28, 28, 1}); // 28 * 28 * 1 -> 24 * 24 * 8
+        ReLuLayer *relu1 = new ReLuLayer(conv1->output->size);
+        PoolLayer *pool1 = new PoolLayer(2, 2, relu1->output->size); // -> 12 * 12 * 8
+        ConvolutionalLayer *conv2 = new ConvolutionalLayer(1, 3, 8, pool1->output->size); // Winograd, -> 10 * 10 * 8
+        ReLuLayer *relu2 = new ReLuLayer(conv2->output->size);
+        FullyConnectedLayer *fc = new FullyConnectedLayer(relu2->output->size, {10, 1, 1}, linear_activation);
+        SoftmaxCrossEntropyLayer *loss = new SoftmaxCrossEntropyLayer(fc->output->size);
+        net.layers = {conv1, relu1, pool1, conv2, relu2, fc, loss};
+        for(Layer *layer: net.layers)
+                layer->optimizer = optimizer;
+        net.network = fuse_conv_relu_pool(net.layers);
+        return net;
+}
+
+static void delete_network(CheckNetwork &net)
+{
+        for(Layer *layer: net.network)
+                if(find(net.layers.begin(), net.layers.end(), layer) == net.layers.end())
+                        delete layer;
+        for(Layer *layer: net.layers)
+                delete layer;
+}
+
+static void fill_batch(TensorFloat &data, TensorFloat &expected)
+{
+        fill_random(data, 0.0f, 1.0f);
+        memset(expected.values, 0, expected.count() * sizeof(float));
+        for(int n = 0; n < expected.batch; n++)
+                expected.sample(n)[rand() % 10] = 1.0f;
+}
+
+static float train_step(vector<Layer*> &layers, Workspace *workspace, TensorFloat *data, TensorFloat *expected)
+{
+        for(int i = 0; i < layers.size(); i++)
+                layers[i]->activate(i == 0 ? data->view() : layers[i - 1]->output->view());
+        for(int i = layers.size() - 1; i >= 0; i--)
+                layers[i]->calc_grads(i == layers.size() - 1 ? expected->view() : layers[i + 1]->input_gradients->view());
+        for(Layer *layer: layers)
+                layer->fix_weights();
+        return ((SoftmaxCrossEntropyLayer*)layers.back())->errors * 100.0f;
+}
+
+static void check_single_thread(int batch)
+{
+        SgdOptimizer optimizer(0.01f, 0.6f, 0.001f);
+        CheckNetwork net = build_network(&optimizer);
+        Workspace workspace(net.network, batch);
+        TensorFloat data(28, 28, 1, batch), expected(10, 1, 1, batch);
+        fill_batch(data, expected);
+
+        for(int step = 0; step < WARMUP_STEPS; step++)
+                train_step(net.network, &workspace, &data, &expected);
+        long before = allocation_count();
+        for(int step = 0; step < CHECK_STEPS; step++)
+                train_step(net.network, &workspace, &data, &expected);
+
+        char what[60];
+        snprintf(what, sizeof(what), "allocations per step, batch %d", batch);
+        check(what, allocation_count() - before, 0);
+        delete_network(net);
+}
+
+static void check_data_parallel(int threads, int batch)
+{
+        SgdOptimizer optimizer(0.01f, 0.6f, 0.001f);
+        CheckNetwork net = build_network(&optimizer);
+        DataParallelTrainer *trainer = new DataParallelTrainer(net.network, threads, batch);
+        TensorFloat data(28, 28, 1, batch), expected(10, 1, 1, batch);
+        fill_batch(data, expected);
+
+        for(int step = 0; step < WARMUP_STEPS; step++)
+                trainer->train(&data, &expected);
+        long before = allocation_count();
+        for(int step = 0; step < CHECK_STEPS; step++)
+                trainer->train(&data, &expected);
+
+        char what[80];
+        snprintf(what, sizeof(what), "allocations per step, DataParallelTrainer, %d threads, batch %d", threads, batch);
+        check(what, allocation_count() - before, 0);
+        delete trainer;
+        delete_network(net);
+}
+
+// The cases of a step go to whichever thread takes them first, so the warm-up lasts until
+// every thread has trained at least one case, seen from its summed loss
+static void check_hogwild(int threads)
+{
+        SgdOptimizer optimizer(0.01f, 0.6f, 0.001f);
+        CheckNetwork net = build_network(&optimizer);
+        HogwildTrainer *hogwild = new HogwildTrainer(net.network, threads, train_step);
+        TensorFloat data(28, 28, 1, HOGWILD_CHUNK), expected(10, 1, 1, HOGWILD_CHUNK);
+        fill_batch(data, expected);
+
+        vector<bool> trained(threads, false);
+        int idle_threads = threads;
+        for(int step = 0; idle_threads > 0 && step < HOGWILD_WARMUP_LIMIT; step++) {
+                hogwild->train(&data, &expected);
+                for(int t = 0; t < threads; t++) {
+                        if(!trained[t] && hogwild->thread_loss[t] > 0) {
+                                trained[t] = true;
+                                idle_threads--;
+                        }
+                }
+        }
+        check("Hogwild threads that never trained during the warm-up", idle_threads, 0);
+
+        long before = allocation_count();
+        for(int step = 0; step < CHECK_STEPS; step++)
+                hogwild->train(&data, &expected);
+
+        char what[60];
+        snprintf(what, sizeof(what), "allocations per step, HogwildTrainer, %d threads", threads);
+        check(what, allocation_count() - before, 0);
+        delete hogwild;
+        delete_network(net);
+}
+
+int main()
+{
+        check_single_thread(1);
+        check_single_thread(8);
+        check_data_parallel(CHECK_THREADS, 6);
+        check_hogwild(CHECK_THREADS);
+
+        return check_failures;
+}